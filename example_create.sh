@@ -4,7 +4,7 @@
 #
 # NOTE, things to do manually (once) before running this script:
 # - copy style.css, logo.png and favicon.png manually, a style.css example
-#   is included.
+#   is included. With stagit -t copy lines.js as well.
 #
 # - write clone url, for example "git://git.codemadness.org/dir" to the "url"
 #   file for each repo.
@@ -36,6 +36,7 @@ for dir in "${reposdir}/"*/; do
 	# symlinks
 	ln -sf log.html index.html
 	ln -sf ../style.css style.css
+	ln -sf ../lines.js lines.js
 	ln -sf ../logo.png logo.png
 	ln -sf ../favicon.png favicon.png
 
@@ -0,0 +1,66 @@
+/* Deep links for the compact markup of stagit -t: the lines have no ids.
+   #l<n> is line n of a file, #h<file>-<hunk>-<line> a line of a diff, the
+   line counted from the hunk header. */
+(function() {
+	var blob = document.getElementById("blob"), cur = null;
+
+	function lines(n) {
+		return n.nodeType == 1 ? 1 : (n.nodeValue.match(/\n/g) || []).length;
+	}
+
+	function find(id) {
+		var m, n, k;
+
+		if ((m = /^l(\d+)$/.exec(id)))
+			return blob ? blob.getElementsByTagName("i")[m[1] - 1] : null;
+		if (!(m = /^(h\d+-\d+)-(\d+)$/.exec(id)) ||
+		    !(n = document.getElementById(m[1])))
+			return null;
+		for (k = +m[2], n = n.nextSibling; n; n = n.nextSibling) {
+			if (k < lines(n))
+				return n.nodeType == 1 ? n : null;
+			k -= lines(n);
+		}
+		return null;
+	}
+
+	/* the id of a line: its number or position in the hunk */
+	function idof(e) {
+		var l, i, k = 0, n;
+
+		if (e.nodeName == "I") {
+			l = blob.getElementsByTagName("i");
+			for (i = 0; i < l.length; i++)
+				if (l[i] == e)
+					return "l" + (i + 1);
+		}
+		if (e.nodeName != "INS" && e.nodeName != "DEL")
+			return null;
+		for (n = e.previousSibling; n; n = n.previousSibling) {
+			if (n.nodeType == 1 && n.className == "h")
+				return n.id + "-" + k;
+			k += lines(n);
+		}
+		return null;
+	}
+
+	function go() {
+		var e = find(location.hash.substring(1));
+
+		if (cur)
+			cur.className = "";
+		if ((cur = e)) {
+			e.className = "t";
+			e.scrollIntoView();
+		}
+	}
+
+	document.addEventListener("click", function(ev) {
+		var id = idof(ev.target);
+
+		if (id)
+			location.hash = id;
+	});
+	window.addEventListener("hashchange", go);
+	go();
+})();
@@ -7,6 +7,10 @@
 #include <unistd.h>
 
 #include <git2.h>
+#include <git2/sys/odb_backend.h>
+
+#include "compat.h"
+#include "util.h"
 
 static git_repository *repo;
 
@@ -14,36 +18,177 @@ static const char *relpath = "";
 
 static char description[255] = "Repositories";
 static char *name = "";
-static char owner[255];
+static struct repometa meta;
 
-void
-joinpath(char *buf, size_t bufsiz, const char *path, const char *path2)
+/* object database of an alternate, shared by all repositories using it */
+struct alternate {
+	char path[PATH_MAX]; /* resolved objects directory */
+	git_odb *odb;
+};
+
+static struct alternate *alternates;
+static size_t nalternates;
+
+/* backend of a repository which reads from a shared alternate */
+struct altbackend {
+	git_odb_backend parent;
+	git_odb *odb;
+};
+
+int
+altbackend_read(void **data, size_t *len, git_object_t *type,
+                git_odb_backend *backend, const git_oid *id)
+{
+	git_odb_object *obj;
+	int r;
+
+	if ((r = git_odb_read(&obj, ((struct altbackend *)backend)->odb, id)))
+		return r;
+	*len = git_odb_object_size(obj);
+	*type = git_odb_object_type(obj);
+	if ((*data = git_odb_backend_data_alloc(backend, *len)))
+		memcpy(*data, git_odb_object_data(obj), *len);
+	git_odb_object_free(obj);
+
+	return *data ? 0 : -1;
+}
+
+int
+altbackend_read_prefix(git_oid *out, void **data, size_t *len,
+                       git_object_t *type, git_odb_backend *backend,
+                       const git_oid *id, size_t idlen)
 {
+	git_odb_object *obj;
 	int r;
 
-	r = snprintf(buf, bufsiz, "%s%s%s",
-		path, path[0] && path[strlen(path) - 1] != '/' ? "/" : "", path2);
-	if (r < 0 || (size_t)r >= bufsiz)
-		errx(1, "path truncated: '%s%s%s'",
-			path, path[0] && path[strlen(path) - 1] != '/' ? "/" : "", path2);
+	if ((r = git_odb_read_prefix(&obj, ((struct altbackend *)backend)->odb,
+	    id, idlen)))
+		return r;
+	git_oid_cpy(out, git_odb_object_id(obj));
+	*len = git_odb_object_size(obj);
+	*type = git_odb_object_type(obj);
+	if ((*data = git_odb_backend_data_alloc(backend, *len)))
+		memcpy(*data, git_odb_object_data(obj), *len);
+	git_odb_object_free(obj);
+
+	return *data ? 0 : -1;
+}
+
+int
+altbackend_read_header(size_t *len, git_object_t *type,
+                       git_odb_backend *backend, const git_oid *id)
+{
+	return git_odb_read_header(len, type,
+	       ((struct altbackend *)backend)->odb, id);
+}
+
+int
+altbackend_exists(git_odb_backend *backend, const git_oid *id)
+{
+	return git_odb_exists(((struct altbackend *)backend)->odb, id);
+}
+
+int
+altbackend_exists_prefix(git_oid *out, git_odb_backend *backend,
+                         const git_oid *id, size_t idlen)
+{
+	return git_odb_exists_prefix(out, ((struct altbackend *)backend)->odb,
+	       id, idlen);
+}
+
+int
+altbackend_refresh(git_odb_backend *backend)
+{
+	return git_odb_refresh(((struct altbackend *)backend)->odb);
 }
 
-/* Escape characters below as HTML 2.0 / XML 1.0. */
 void
-xmlencode(FILE *fp, const char *s, size_t len)
+altbackend_free(git_odb_backend *backend)
+{
+	free(backend);
+}
+
+/* object database of the alternate with the resolved path, opened once */
+git_odb *
+alternate_odb(const char *path)
 {
+	git_odb *odb;
 	size_t i;
 
-	for (i = 0; *s && i < len; s++, i++) {
-		switch(*s) {
-		case '<':  fputs("&lt;",   fp); break;
-		case '>':  fputs("&gt;",   fp); break;
-		case '\'': fputs("&#39;" , fp); break;
-		case '&':  fputs("&amp;",  fp); break;
-		case '"':  fputs("&quot;", fp); break;
-		default:   fputc(*s, fp);
+	for (i = 0; i < nalternates; i++)
+		if (!strcmp(alternates[i].path, path))
+			return alternates[i].odb;
+	if (git_odb_open(&odb, path))
+		return NULL;
+	if (!(alternates = reallocarray(alternates, nalternates + 1,
+	    sizeof(*alternates))))
+		err(1, "realloc");
+	strlcpy(alternates[nalternates].path, path,
+	        sizeof(alternates[nalternates].path));
+	alternates[nalternates].odb = odb;
+
+	return alternates[nalternates++].odb;
+}
+
+/* Give the repository an object database of its own objects and of the
+   shared object databases of its alternates: forks using the same object
+   pool then reuse its pack indexes, windows and object cache instead of
+   reading and decoding them again per repository. A repository without
+   alternates keeps the object database of libgit2. */
+void
+openalternates(void)
+{
+	struct altbackend *ab;
+	git_odb *odb = NULL, *altodb;
+	git_odb_backend *backend;
+	FILE *fp;
+	char objdir[PATH_MAX], path[PATH_MAX], abspath[PATH_MAX], line[PATH_MAX];
+
+	joinpath(objdir, sizeof(objdir), git_repository_path(repo), "objects");
+	joinpath(path, sizeof(path), objdir, "info/alternates");
+	if (!(fp = fopen(path, "r")))
+		return;
+
+	/* its own packs and loose objects, packs are looked up first */
+	if (git_odb_new(&odb) ||
+	    git_odb_backend_pack(&backend, objdir) ||
+	    git_odb_add_backend(odb, backend, 2) ||
+	    git_odb_backend_loose(&backend, objdir, -1, 0, 0, 0) ||
+	    git_odb_add_backend(odb, backend, 1))
+		goto err;
+
+	while (fgets(line, sizeof(line), fp)) {
+		line[strcspn(line, "\n")] = '\0';
+		if (!line[0] || line[0] == '#')
+			continue;
+		/* relative paths are relative to the objects directory */
+		if (line[0] == '/')
+			strlcpy(path, line, sizeof(path));
+		else
+			joinpath(path, sizeof(path), objdir, line);
+		if (!realpath(path, abspath) || !(altodb = alternate_odb(abspath)))
+			continue;
+
+		if (!(ab = calloc(1, sizeof(*ab))))
+			err(1, "calloc");
+		ab->parent.version = GIT_ODB_BACKEND_VERSION;
+		ab->parent.read = altbackend_read;
+		ab->parent.read_prefix = altbackend_read_prefix;
+		ab->parent.read_header = altbackend_read_header;
+		ab->parent.exists = altbackend_exists;
+		ab->parent.exists_prefix = altbackend_exists_prefix;
+		ab->parent.refresh = altbackend_refresh;
+		ab->parent.free = altbackend_free;
+		ab->odb = altodb;
+		if (git_odb_add_alternate(odb, &(ab->parent), 2)) {
+			free(ab);
+			goto err;
 		}
 	}
+	git_repository_set_odb(repo, odb);
+err:
+	git_odb_free(odb);
+	fclose(fp);
 }
 
 void
@@ -122,9 +267,9 @@ writelog(FILE *fp)
 	fputs("/log.html\">", fp);
 	xmlencode(fp, stripped_name, strlen(stripped_name));
 	fputs("</a></td><td>", fp);
-	xmlencode(fp, description, strlen(description));
+	xmlencode(fp, meta.description, strlen(meta.description));
 	fputs("</td><td>", fp);
-	xmlencode(fp, owner, strlen(owner));
+	xmlencode(fp, meta.owner, strlen(meta.owner));
 	fputs("</td><td>", fp);
 	if (author)
 		printtimeshort(fp, &(author->when));
@@ -141,9 +286,9 @@ err:
 int
 main(int argc, char *argv[])
 {
-	FILE *fp;
-	char path[PATH_MAX], repodirabs[PATH_MAX + 1];
+	char repodirabs[PATH_MAX + 1];
 	const char *repodir;
+	size_t j;
 	int i, ret = 0;
 
 	if (argc < 2) {
@@ -182,38 +327,19 @@ main(int argc, char *argv[])
 		else
 			name = "";
 
-		/* read description or .git/description */
-		joinpath(path, sizeof(path), repodir, "description");
-		if (!(fp = fopen(path, "r"))) {
-			joinpath(path, sizeof(path), repodir, ".git/description");
-			fp = fopen(path, "r");
-		}
-		description[0] = '\0';
-		if (fp) {
-			if (!fgets(description, sizeof(description), fp))
-				description[0] = '\0';
-			fclose(fp);
-		}
-
-		/* read owner or .git/owner */
-		joinpath(path, sizeof(path), repodir, "owner");
-		if (!(fp = fopen(path, "r"))) {
-			joinpath(path, sizeof(path), repodir, ".git/owner");
-			fp = fopen(path, "r");
-		}
-		owner[0] = '\0';
-		if (fp) {
-			if (!fgets(owner, sizeof(owner), fp))
-				owner[0] = '\0';
-			owner[strcspn(owner, "\n")] = '\0';
-			fclose(fp);
-		}
+		openalternates();
+		readmeta(repo, repodir, &meta);
 		writelog(stdout);
+
+		git_repository_free(repo);
+		repo = NULL;
 	}
 	writefooter(stdout);
 
 	/* cleanup */
-	git_repository_free(repo);
+	for (j = 0; j < nalternates; j++)
+		git_odb_free(alternates[j].odb);
+	free(alternates);
 	git_libgit2_shutdown();
 
 	return ret;
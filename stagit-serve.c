@@ -0,0 +1,919 @@
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#else
+#include <poll.h>
+#endif
+
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "compat.h"
+
+#define TIMEOUT    60      /* seconds a connection may be idle */
+#define REQSIZ     8192    /* maximum size of the request header */
+#define MAXEVENTS  256
+
+/* manifest entry, the manifest of stagit -m or the index of stagit -a */
+struct entry {
+	char *path;
+	char hash[41];
+	char source[41];         /* content hash of the page of a member */
+	off_t offset;            /* content in the archive */
+	off_t len;
+};
+
+struct conn {
+	int fd;
+	char req[REQSIZ];        /* request data read but not handled yet */
+	size_t reqlen;
+	char hdr[1024];          /* response header */
+	size_t hdrlen, hdroff;
+	int filefd;              /* response body */
+	off_t off, end;
+	int keepalive;
+	int writing;             /* waiting to write the response */
+	time_t last;
+};
+
+enum { EV_READ = 1, EV_WRITE = 2, EV_ERROR = 4 };
+
+struct event {
+	int fd;
+	int flags;
+};
+
+static const char *indexfile;   /* manifest or archive index */
+static const char *archivefile;
+static int archivefd = -1;
+static struct entry *entries;
+static size_t nentries;
+static struct stat indexst;
+
+static struct conn **conns;     /* by file descriptor */
+static size_t nconns;
+static int listenfd;
+
+static char datestr[64];
+static time_t now;
+
+#ifdef __linux__
+static int epollfd;
+#else
+static struct pollfd *pfds;
+static size_t npfds;
+#endif
+
+int
+entry_cmp(const void *v1, const void *v2)
+{
+	return strcmp(((struct entry *)v1)->path, ((struct entry *)v2)->path);
+}
+
+struct entry *
+entry_find(const char *path)
+{
+	struct entry key;
+
+	key.path = (char *)path;
+	return bsearch(&key, entries, nentries, sizeof(*entries), entry_cmp);
+}
+
+void
+entries_free(struct entry *e, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		free(e[i].path);
+	free(e);
+}
+
+/* read the manifest again when stagit replaced it. The archive is opened
+   again together with its index: it is replaced before the index when it
+   is compacted, so the old index and old archive stay consistent */
+void
+loadindex(void)
+{
+	struct entry *e = NULL;
+	struct stat st;
+	FILE *fp;
+	char *line = NULL;
+	size_t linesiz = 0, n = 0;
+	long long offset = 0, len = 0;
+	int fd = -1, r, pos, ok = 1;
+
+	if (!indexfile)
+		return;
+	if (stat(indexfile, &st) == -1) {
+		warn("stat: '%s'", indexfile);
+		return;
+	}
+	if (nentries && st.st_ino == indexst.st_ino && st.st_dev == indexst.st_dev &&
+	    st.st_mtime == indexst.st_mtime && st.st_size == indexst.st_size)
+		return;
+	if (!(fp = fopen(indexfile, "r"))) {
+		warn("fopen: '%s'", indexfile);
+		return;
+	}
+	if (archivefile && (fd = open(archivefile, O_RDONLY)) == -1) {
+		warn("open: '%s'", archivefile);
+		fclose(fp);
+		return;
+	}
+
+	while (getline(&line, &linesiz, fp) > 0) {
+		line[strcspn(line, "\n")] = '\0';
+		if (!(e = reallocarray(e, n + 1, sizeof(*e))))
+			err(1, "realloc");
+		if (archivefile)
+			r = sscanf(line, "%40s %40s %lld %lld %n", e[n].hash,
+			           e[n].source, &offset, &len, &pos) == 4;
+		else
+			r = sscanf(line, "%40s %40s %n", e[n].hash, e[n].source,
+			           &pos) == 2;
+		if (!r || !line[pos] || offset < 0 || len < 0) {
+			warnx("%s: invalid line", indexfile);
+			ok = 0;
+			break;
+		}
+		if (!(e[n].path = strdup(line + pos)))
+			err(1, "strdup");
+		e[n].offset = (off_t)offset;
+		e[n].len = (off_t)len;
+		n++;
+	}
+	free(line);
+	if (ferror(fp))
+		ok = 0;
+	fclose(fp);
+	if (!ok) {
+		entries_free(e, n);
+		if (fd != -1)
+			close(fd);
+		return;
+	}
+	qsort(e, n, sizeof(*e), entry_cmp);
+
+	entries_free(entries, nentries);
+	entries = e;
+	nentries = n;
+	indexst = st;
+	if (archivefd != -1)
+		close(archivefd);
+	archivefd = fd;
+}
+
+void
+updatedate(void)
+{
+	struct tm *tm;
+	time_t t;
+
+	if ((t = time(NULL)) == now)
+		return;
+	now = t;
+	if ((tm = gmtime(&t)))
+		strftime(datestr, sizeof(datestr), "%a, %d %b %Y %H:%M:%S GMT", tm);
+}
+
+const char *
+mimetype(const char *path)
+{
+	static const struct {
+		const char *ext, *type;
+	} types[] = {
+		{ ".html", "text/html; charset=UTF-8" },
+		{ ".xml",  "application/atom+xml; charset=UTF-8" },
+		{ ".css",  "text/css" },
+		{ ".js",   "text/javascript" },
+		{ ".png",  "image/png" },
+		{ ".txt",  "text/plain; charset=UTF-8" },
+	};
+	const char *p;
+	size_t i;
+
+	if (!(p = strrchr(path, '.')) || strchr(p, '/'))
+		return "application/octet-stream";
+	for (i = 0; i < sizeof(types) / sizeof(*types); i++)
+		if (!strcmp(p, types[i].ext))
+			return types[i].type;
+	return "application/octet-stream";
+}
+
+/* the value of a header field in the request header, NULL if not set */
+const char *
+headerfield(const char *hdr, const char *name, char *buf, size_t bufsiz)
+{
+	const char *p, *e;
+	size_t len = strlen(name);
+
+	for (p = strstr(hdr, "\r\n"); p && p[2] != '\r'; p = strstr(p + 2, "\r\n")) {
+		if (strncasecmp(p + 2, name, len) || p[2 + len] != ':')
+			continue;
+		p += 3 + len;
+		p += strspn(p, " \t");
+		if (!(e = strstr(p, "\r\n")))
+			return NULL;
+		if ((size_t)(e - p) >= bufsiz)
+			e = p + bufsiz - 1;
+		memcpy(buf, p, e - p);
+		buf[e - p] = '\0';
+		return buf;
+	}
+	return NULL;
+}
+
+/* the coding is in the list of the Accept-Encoding field and not q=0 */
+int
+acceptencoding(const char *list, const char *coding)
+{
+	const char *p, *q;
+	size_t len = strlen(coding);
+
+	if (!list)
+		return 0;
+	for (p = list; *p; p += strcspn(p, ",")) {
+		p += strspn(p, ", \t");
+		if (strncasecmp(p, coding, len) || !strchr(",; \t", p[len]))
+			continue;
+		q = p + len + strspn(p + len, " \t");
+		if (*q == ';' && (q = strstr(q, "q=")) &&
+		    q < p + strcspn(p, ",") && strtod(q + 2, NULL) <= 0)
+			return 0;
+		return 1;
+	}
+	return 0;
+}
+
+/* decode the request target to a relative path, -1 if it is not valid */
+int
+decodepath(const char *target, char *buf, size_t bufsiz)
+{
+	const char *s;
+	char *d, hex[3] = "";
+	size_t i;
+
+	if (*target != '/')
+		return -1;
+	for (s = target + 1, i = 0; *s && *s != '?' && *s != '#'; s++) {
+		if (i + 1 >= bufsiz)
+			return -1;
+		if (*s == '%') {
+			if (!isxdigit((unsigned char)s[1]) ||
+			    !isxdigit((unsigned char)s[2]))
+				return -1;
+			hex[0] = s[1];
+			hex[1] = s[2];
+			if (!(buf[i++] = (char)strtol(hex, NULL, 16)))
+				return -1;
+			s += 2;
+		} else {
+			buf[i++] = *s;
+		}
+	}
+	buf[i] = '\0';
+
+	/* no empty, "." or ".." path components */
+	for (d = buf; *d; d += strcspn(d, "/"), d += *d == '/') {
+		if (*d == '/' || (d[0] == '.' && (!d[1] || d[1] == '/')) ||
+		    (d[0] == '.' && d[1] == '.' && (!d[2] || d[2] == '/')))
+			return -1;
+	}
+	return 0;
+}
+
+void
+ev_init(void)
+{
+#ifdef __linux__
+	if ((epollfd = epoll_create1(0)) == -1)
+		err(1, "epoll_create1");
+#endif
+}
+
+void
+ev_add(int fd)
+{
+#ifdef __linux__
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+		err(1, "epoll_ctl");
+#endif
+}
+
+/* wait for the connection to be writable instead of readable */
+void
+ev_write(struct conn *c, int writing)
+{
+#ifdef __linux__
+	struct epoll_event ev;
+
+	if (c->writing == writing)
+		return;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = writing ? EPOLLOUT : EPOLLIN;
+	ev.data.fd = c->fd;
+	if (epoll_ctl(epollfd, EPOLL_CTL_MOD, c->fd, &ev) == -1)
+		err(1, "epoll_ctl");
+#endif
+	c->writing = writing;
+}
+
+/* wait at most a second for events: the idle connections are closed */
+int
+ev_wait(struct event *events, int max)
+{
+#ifdef __linux__
+	struct epoll_event ev[MAXEVENTS];
+	int i, n;
+
+	if (max > MAXEVENTS)
+		max = MAXEVENTS;
+	if ((n = epoll_wait(epollfd, ev, max, 1000)) == -1) {
+		if (errno == EINTR)
+			return 0;
+		err(1, "epoll_wait");
+	}
+	for (i = 0; i < n; i++) {
+		events[i].fd = ev[i].data.fd;
+		events[i].flags = (ev[i].events & EPOLLIN ? EV_READ : 0) |
+		                  (ev[i].events & EPOLLOUT ? EV_WRITE : 0) |
+		                  (ev[i].events & (EPOLLERR | EPOLLHUP) ? EV_ERROR : 0);
+	}
+	return n;
+#else
+	size_t i, n = 0;
+	int r;
+
+	if (npfds < nconns + 1) {
+		if (!(pfds = reallocarray(pfds, nconns + 1, sizeof(*pfds))))
+			err(1, "realloc");
+		npfds = nconns + 1;
+	}
+	pfds[n].fd = listenfd;
+	pfds[n++].events = POLLIN;
+	for (i = 0; i < nconns; i++) {
+		if (!conns[i])
+			continue;
+		pfds[n].fd = conns[i]->fd;
+		pfds[n++].events = conns[i]->writing ? POLLOUT : POLLIN;
+	}
+	if ((r = poll(pfds, n, 1000)) == -1) {
+		if (errno == EINTR)
+			return 0;
+		err(1, "poll");
+	}
+	for (i = 0, r = 0; i < n && r < max; i++) {
+		if (!pfds[i].revents)
+			continue;
+		events[r].fd = pfds[i].fd;
+		events[r].flags = (pfds[i].revents & POLLIN ? EV_READ : 0) |
+		                  (pfds[i].revents & POLLOUT ? EV_WRITE : 0) |
+		                  (pfds[i].revents & (POLLERR | POLLHUP | POLLNVAL) ?
+		                   EV_ERROR : 0);
+		r++;
+	}
+	return r;
+#endif
+}
+
+void
+conn_close(struct conn *c)
+{
+	if (c->filefd != -1)
+		close(c->filefd);
+	/* closing the descriptor removes it from the epoll set */
+	close(c->fd);
+	conns[c->fd] = NULL;
+	free(c);
+}
+
+void
+conn_new(int fd)
+{
+	struct conn *c;
+	size_t n;
+
+	if ((size_t)fd >= nconns) {
+		n = fd + 64;
+		if (!(conns = reallocarray(conns, n, sizeof(*conns))))
+			err(1, "realloc");
+		memset(conns + nconns, 0, (n - nconns) * sizeof(*conns));
+		nconns = n;
+	}
+	if (!(c = calloc(1, sizeof(*c))))
+		err(1, "calloc");
+	c->fd = fd;
+	c->filefd = -1;
+	c->last = now;
+	conns[fd] = c;
+	ev_add(fd);
+}
+
+/* start a response: the header, the body is sent from filefd. Without a
+   body len is -1 */
+void
+respond(struct conn *c, const char *status, const char *type, off_t len,
+        const char *etag, const char *encoding)
+{
+	char clen[64] = "";
+	int r;
+
+	if (len >= 0)
+		snprintf(clen, sizeof(clen), "Content-Length: %lld\r\n",
+		         (long long)len);
+	r = snprintf(c->hdr, sizeof(c->hdr),
+		"HTTP/1.1 %s\r\n"
+		"Date: %s\r\n"
+		"Server: stagit-serve\r\n"
+		"%s%s%s"
+		"%s"
+		"%s%s%s"
+		"%s%s%s"
+		"Vary: Accept-Encoding\r\n"
+		"%s"
+		"\r\n",
+		status, datestr,
+		type ? "Content-Type: " : "", type ? type : "", type ? "\r\n" : "",
+		clen,
+		etag ? "ETag: \"" : "", etag ? etag : "", etag ? "\"\r\n" : "",
+		encoding ? "Content-Encoding: " : "", encoding ? encoding : "",
+		encoding ? "\r\n" : "",
+		c->keepalive ? "" : "Connection: close\r\n");
+	if (r < 0 || (size_t)r >= sizeof(c->hdr))
+		errx(1, "response header truncated");
+	c->hdrlen = r;
+	c->hdroff = 0;
+}
+
+/* the body of an error is the status itself, sent after the header */
+void
+respond_error(struct conn *c, const char *status)
+{
+	size_t len = strlen(status) + 1;
+
+	respond(c, status, "text/plain; charset=UTF-8", len, NULL, NULL);
+	if (c->hdrlen + len >= sizeof(c->hdr))
+		errx(1, "response header truncated");
+	snprintf(c->hdr + c->hdrlen, sizeof(c->hdr) - c->hdrlen, "%s\n", status);
+	c->hdrlen += len;
+}
+
+/* open a file of the output directory, only regular files */
+int
+openfile(const char *path, struct stat *st)
+{
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_NONBLOCK)) == -1)
+		return -1;
+	if (fstat(fd, st) == -1 || !S_ISREG(st->st_mode)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* find the page: in the archive or the output directory, where a
+   precompressed variant path.br or path.gz is preferred when accepted. In
+   the archive a variant is a member made from the current page */
+int
+openpage(struct conn *c, const char *path, const char *ae,
+         char *etag, size_t etagsiz, const char **encoding)
+{
+	static const char *codings[][2] = {
+		{ "br", ".br" }, { "gzip", ".gz" },
+	};
+	struct entry *e, *v = NULL;
+	struct stat st;
+	char vpath[PATH_MAX];
+	size_t i;
+	int fd = -1;
+
+	*encoding = NULL;
+	e = entry_find(path);
+	if (archivefile) {
+		if (!e)
+			return -1;
+		for (i = 0; i < sizeof(codings) / sizeof(*codings) && !v; i++) {
+			if (!acceptencoding(ae, codings[i][0]) ||
+			    snprintf(vpath, sizeof(vpath), "%s%s", path,
+			    codings[i][1]) >= (int)sizeof(vpath))
+				continue;
+			if ((v = entry_find(vpath)) && !strcmp(v->source, e->hash))
+				*encoding = codings[i][0];
+			else
+				v = NULL;
+		}
+		if ((fd = dup(archivefd)) == -1)
+			return -1;
+		c->filefd = fd;
+		c->off = v ? v->offset : e->offset;
+		c->end = v ? v->offset + v->len : e->offset + e->len;
+		snprintf(etag, etagsiz, "%s%s%s", e->hash,
+		         *encoding ? "-" : "", *encoding ? *encoding : "");
+		return 0;
+	}
+
+	for (i = 0; i < sizeof(codings) / sizeof(*codings) && fd == -1; i++) {
+		if (!acceptencoding(ae, codings[i][0]) ||
+		    snprintf(vpath, sizeof(vpath), "%s%s", path, codings[i][1]) >=
+		    (int)sizeof(vpath))
+			continue;
+		if ((fd = openfile(vpath, &st)) != -1)
+			*encoding = codings[i][0];
+	}
+	if (fd == -1 && (fd = openfile(path, &st)) == -1)
+		return -1;
+	c->filefd = fd;
+	c->off = 0;
+	c->end = st.st_size;
+
+	/* the content hash of the manifest, else the modification time and
+	   size as most servers do */
+	if (e)
+		snprintf(etag, etagsiz, "%s%s%s", e->hash,
+		         *encoding ? "-" : "", *encoding ? *encoding : "");
+	else
+		snprintf(etag, etagsiz, "%llx-%llx%s%s",
+		         (long long)st.st_mtime, (long long)st.st_size,
+		         *encoding ? "-" : "", *encoding ? *encoding : "");
+	return 0;
+}
+
+/* the If-None-Match field lists the entity tag */
+int
+etagmatch(const char *inm, const char *etag)
+{
+	const char *p, *e;
+	size_t len = strlen(etag);
+
+	if (!inm)
+		return 0;
+	if (!strcmp(inm, "*"))
+		return 1;
+	for (p = inm; (p = strchr(p, '"')) && (e = strchr(p + 1, '"')); p = e + 1)
+		if ((size_t)(e - p - 1) == len && !strncmp(p + 1, etag, len))
+			return 1;
+	return 0;
+}
+
+/* handle a complete request header, the end is the last CRLF */
+void
+request(struct conn *c, char *hdr)
+{
+	const char *indexes[] = { "index.html", "log.html" };
+	const char *encoding = NULL;
+	char method[16], target[PATH_MAX], version[16];
+	char path[PATH_MAX], tpath[PATH_MAX];
+	char field[256], ae[256], inm[256], etag[64];
+	const char *aep, *inmp;
+	size_t i, len;
+	int head, r;
+
+	if (sscanf(hdr, "%15s %4095s %15s", method, target, version) != 3 ||
+	    strncmp(version, "HTTP/1.", 7)) {
+		c->keepalive = 0;
+		respond_error(c, "400 Bad Request");
+		return;
+	}
+	if (!headerfield(hdr, "Connection", field, sizeof(field)))
+		field[0] = '\0';
+	if (!strcmp(version, "HTTP/1.0"))
+		c->keepalive = !strcasecmp(field, "keep-alive");
+	else
+		c->keepalive = strcasecmp(field, "close") != 0;
+
+	head = !strcmp(method, "HEAD");
+	if (!head && strcmp(method, "GET")) {
+		respond_error(c, "405 Method Not Allowed");
+		return;
+	}
+	if (decodepath(target, path, sizeof(path)) == -1) {
+		respond_error(c, "400 Bad Request");
+		return;
+	}
+	aep = headerfield(hdr, "Accept-Encoding", ae, sizeof(ae));
+	inmp = headerfield(hdr, "If-None-Match", inm, sizeof(inm));
+
+	len = strlen(path);
+	if (!len || path[len - 1] == '/') {
+		for (i = 0, r = -1; i < sizeof(indexes) / sizeof(*indexes) && r == -1; i++)
+			if (snprintf(tpath, sizeof(tpath), "%s%s", path, indexes[i]) <
+			    (int)sizeof(tpath))
+				r = openpage(c, tpath, aep, etag, sizeof(etag), &encoding);
+	} else {
+		strlcpy(tpath, path, sizeof(tpath));
+		r = openpage(c, tpath, aep, etag, sizeof(etag), &encoding);
+	}
+	if (r == -1) {
+		respond_error(c, "404 Not Found");
+		return;
+	}
+
+	if (etagmatch(inmp, etag)) {
+		respond(c, "304 Not Modified", NULL, -1, etag, NULL);
+		head = 1;
+	} else {
+		respond(c, "200 OK", mimetype(tpath), c->end - c->off, etag, encoding);
+	}
+	if (head) {
+		close(c->filefd);
+		c->filefd = -1;
+	}
+}
+
+/* write the pending response, 1 if it would block, -1 on error */
+int
+conn_write(struct conn *c)
+{
+	ssize_t n;
+#ifndef __linux__
+	char buf[16384];
+	size_t len;
+#endif
+
+	while (c->hdroff < c->hdrlen) {
+		if ((n = write(c->fd, c->hdr + c->hdroff, c->hdrlen - c->hdroff)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+		}
+		c->hdroff += n;
+		c->last = now;
+	}
+	while (c->filefd != -1 && c->off < c->end) {
+#ifdef __linux__
+		n = sendfile(c->fd, c->filefd, &c->off, c->end - c->off);
+#else
+		len = c->end - c->off < (off_t)sizeof(buf) ?
+		      (size_t)(c->end - c->off) : sizeof(buf);
+		if ((n = pread(c->filefd, buf, len, c->off)) > 0 &&
+		    (n = write(c->fd, buf, n)) > 0)
+			c->off += n;
+#endif
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+		}
+		if (n == 0)
+			return -1; /* file truncated */
+		c->last = now;
+	}
+	if (c->filefd != -1) {
+		close(c->filefd);
+		c->filefd = -1;
+	}
+	c->hdrlen = c->hdroff = 0;
+	return 0;
+}
+
+/* handle the buffered requests and write the responses until a response
+   would block or no complete request is buffered */
+void
+conn_process(struct conn *c)
+{
+	char *end;
+	size_t len;
+	int r;
+
+	for (;;) {
+		if (c->hdrlen) {
+			if ((r = conn_write(c)) == -1) {
+				conn_close(c);
+				return;
+			}
+			if (r == 1) {
+				ev_write(c, 1);
+				return;
+			}
+			if (!c->keepalive) {
+				conn_close(c);
+				return;
+			}
+		}
+		ev_write(c, 0);
+
+		c->req[c->reqlen] = '\0';
+		if (!(end = strstr(c->req, "\r\n\r\n"))) {
+			if (c->reqlen >= sizeof(c->req) - 1 ||
+			    strlen(c->req) != c->reqlen) {
+				c->keepalive = 0;
+				respond_error(c, "400 Bad Request");
+				continue;
+			}
+			return;
+		}
+		end[2] = '\0';
+		len = end + 4 - c->req;
+		request(c, c->req);
+		memmove(c->req, c->req + len, c->reqlen - len);
+		c->reqlen -= len;
+	}
+}
+
+void
+conn_read(struct conn *c)
+{
+	ssize_t n;
+
+	/* the previous response is not written yet */
+	if (c->hdrlen)
+		return;
+	n = read(c->fd, c->req + c->reqlen, sizeof(c->req) - 1 - c->reqlen);
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return;
+	if (n <= 0) {
+		conn_close(c);
+		return;
+	}
+	c->reqlen += n;
+	c->last = now;
+	conn_process(c);
+}
+
+void
+acceptconns(void)
+{
+	int fd;
+
+	while ((fd = accept(listenfd, NULL, NULL)) != -1) {
+		if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+			close(fd);
+			continue;
+		}
+		conn_new(fd);
+	}
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+	    errno != ECONNABORTED)
+		warn("accept");
+}
+
+void
+closeidle(void)
+{
+	size_t i;
+
+	for (i = 0; i < nconns; i++)
+		if (conns[i] && now - conns[i]->last > TIMEOUT)
+			conn_close(conns[i]);
+}
+
+int
+listenon(const char *host, const char *port)
+{
+	struct addrinfo hints, *res, *ai;
+	int fd = -1, on = 1, r;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if ((r = getaddrinfo(host, port, &hints, &res)))
+		errx(1, "getaddrinfo: %s: %s", host, gai_strerror(r));
+	for (ai = res; ai; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1)
+			continue;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+		    listen(fd, SOMAXCONN) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd == -1)
+		err(1, "cannot listen on %s port %s", host, port);
+	if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1)
+		err(1, "fcntl");
+	return fd;
+}
+
+void
+usage(char *argv0)
+{
+	fprintf(stderr, "%s [-l address] [-p port] [-m manifest | -a archive] "
+	        "[dir]\n", argv0);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct event events[MAXEVENTS];
+	struct rlimit rl;
+	struct conn *c;
+	const char *dir = ".", *host = "127.0.0.1", *port = "8080";
+	char archiveindex[PATH_MAX], indexabs[PATH_MAX], archiveabs[PATH_MAX];
+	time_t lastcheck = 0;
+	int i, n;
+
+	for (i = 1; i < argc; i++) {
+		if (argv[i][0] != '-') {
+			if (i + 1 != argc)
+				usage(argv[0]);
+			dir = argv[i];
+		} else if (argv[i][1] == 'l' && i + 1 < argc) {
+			host = argv[++i];
+		} else if (argv[i][1] == 'p' && i + 1 < argc) {
+			port = argv[++i];
+		} else if (argv[i][1] == 'm' && i + 1 < argc && !archivefile) {
+			indexfile = argv[++i];
+		} else if (argv[i][1] == 'a' && i + 1 < argc && !indexfile) {
+			archivefile = argv[++i];
+			if (snprintf(archiveindex, sizeof(archiveindex), "%s.idx",
+			    archivefile) >= (int)sizeof(archiveindex))
+				errx(1, "path truncated: '%s.idx'", archivefile);
+			indexfile = archiveindex;
+		} else {
+			usage(argv[0]);
+		}
+	}
+
+	/* paths relative to the working directory, not the served directory */
+	if (indexfile) {
+		if (!realpath(indexfile, indexabs))
+			err(1, "realpath: '%s'", indexfile);
+		indexfile = indexabs;
+	}
+	if (archivefile) {
+		if (!realpath(archivefile, archiveabs))
+			err(1, "realpath: '%s'", archivefile);
+		archivefile = archiveabs;
+	}
+	if (!archivefile && chdir(dir) == -1)
+		err(1, "chdir: '%s'", dir);
+
+	signal(SIGPIPE, SIG_IGN);
+	/* a descriptor per connection */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	listenfd = listenon(host, port);
+
+#ifdef __OpenBSD__
+	if (unveil(archivefile ? archivefile : ".", "r") == -1)
+		err(1, "unveil: %s", archivefile ? archivefile : dir);
+	if (indexfile && unveil(indexfile, "r") == -1)
+		err(1, "unveil: %s", indexfile);
+	if (pledge("stdio rpath inet", NULL) == -1)
+		err(1, "pledge");
+#endif
+
+	updatedate();
+	loadindex();
+	if (archivefile && archivefd == -1)
+		errx(1, "cannot read archive: '%s'", archivefile);
+
+	ev_init();
+	ev_add(listenfd);
+	for (;;) {
+		n = ev_wait(events, MAXEVENTS);
+		updatedate();
+		/* pick up a new manifest of stagit at most once a second */
+		if (now != lastcheck) {
+			loadindex();
+			closeidle();
+			lastcheck = now;
+		}
+		for (i = 0; i < n; i++) {
+			if (events[i].fd == listenfd) {
+				acceptconns();
+				continue;
+			}
+			if ((size_t)events[i].fd >= nconns || !(c = conns[events[i].fd]))
+				continue;
+			if (events[i].flags & EV_WRITE)
+				conn_process(c);
+			else if (events[i].flags & EV_READ)
+				conn_read(c);
+			else
+				conn_close(c);
+		}
+	}
+
+	return 0;
+}
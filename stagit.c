@@ -1,18 +1,28 @@
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <dirent.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 #include <unistd.h>
 
 #include <git2.h>
+#include <zlib.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 #ifdef USE_LOWDOWN
 #include <sys/queue.h>
@@ -20,9 +30,23 @@
 #endif
 
 #include "compat.h"
+#include "util.h"
+
+#define JOBSPERWORKER 16 /* maximum jobs in flight per worker */
+#define COMMITRUN 8 /* consecutive commits of the log for one worker */
+#define PACKGAP (64 * 1024) /* read ahead adjacent objects as one range */
+#define FRAGFILES 100 /* files per page of the diff of a large commit */
+#define FRAGLINES 10000 /* changed lines per page of a large commit */
+
+/* gitattributes of a path: diff and pages not written */
+#define ATTR_BINARY    1 /* -diff or binary */
+#define ATTR_GENERATED 2 /* linguist-generated */
 
 struct deltainfo {
-	git_patch *patch;
+	git_patch *patch;        /* NULL if not diffed or not kept */
+	const git_diff_delta *delta;
+	const char *suppressed;  /* shown instead of the diff */
+	size_t fragment;         /* page of the diff of a large commit */
 
 	size_t addcount;
 	size_t delcount;
@@ -48,26 +72,203 @@ struct commitinfo {
 	size_t addcount;
 	size_t delcount;
 	size_t filecount;
+	int overbudget;          /* files not diffed for the CPU time budget */
 
 	struct deltainfo **deltas;
 	size_t ndeltas;
 };
 
-static git_repository *repo;
+/* unit of work for the worker threads, results are written by the main
+   thread in the order the jobs were submitted */
+struct job {
+	void (*run)(struct job *);  /* in a worker thread, NULL if none */
+	void (*emit)(struct job *); /* in the main thread, in order, NULL if none */
+	int done;
+	int error;
+
+	FILE *fp;                /* output of emit */
+	git_oid id;
+	char path[PATH_MAX];     /* commit or blob file, full name of reference */
+	char name[PATH_MAX];     /* path of tree entry or name of reference */
+	int exists;              /* commit file already written */
+	git_filemode_t mode;
+	git_off_t filesize;
+	int lc;
+	int n;                   /* section of references or index of file */
+	int attrs;               /* attribute files apply to the path */
+	int follows;             /* for the same worker as the previous job */
+
+	char *row;               /* formatted log line or table row */
+	size_t rowlen;
+	int hasparent;
+
+	git_oid peeled;          /* commit of reference */
+	git_time when;
+	char *author;
+
+	struct job *next;
+};
+
+/* pack and position of an object, to read files in pack order */
+struct pack {
+	int fd;                 /* .pack file */
+	off_t packsize;
+	unsigned char *idx;     /* mapped .idx file */
+	size_t idxsize;
+	uint32_t nobjects;
+	uint64_t *offsets;      /* sorted offsets of all objects */
+};
+
+struct packorder {
+	size_t pack;            /* npacks if not in a pack */
+	uint64_t offset;
+	struct job *job;
+};
+
+struct row {
+	char *s;
+	size_t len;
+	FILE *fp;
+};
+
+/* submodule in .gitmodules and its commit in HEAD */
+struct submodule {
+	char *name;
+	char *path;
+	char *url;
+	git_oid id;
+	int found;
+};
+
+/* tag and the date of its commit, to find the previous tag */
+struct tag {
+	char *name;
+	char *refname;
+	git_oid target;          /* tag object or commit */
+	git_oid peeled;
+	git_time_t time;
+	git_oid source;          /* what its page is made of */
+	int write;               /* page is new or outdated */
+};
+
+/* cached commit of a reference, valid while its target is the same */
+struct refcache {
+	char *name;
+	git_oid target;
+	git_oid peeled;
+	git_time when;
+	char *author;
+	int seen;                /* reference still has this target */
+};
+
+/* output page being written, in memory with a manifest */
+struct page {
+	FILE *fp;
+	char *buf;
+	size_t len;
+	char path[PATH_MAX];
+	git_oid source;
+	struct page *next;
+};
+
+/* output file: hash of its content and the object it was made of */
+struct manifestentry {
+	char *path;
+	git_oid hash;
+	git_oid source;
+	off_t offset;            /* content in the archive */
+	size_t len;
+	int seen;                /* written or kept in this run */
+};
+
+/* hash set of object ids, the zero id marks an empty slot */
+struct oidset {
+	git_oid *ids;
+	size_t n, size;
+};
+
+/* each worker has its own deque of jobs, idle workers steal from others */
+struct worker {
+	pthread_t thread;
+	struct job **jobs;
+	size_t head, len;
+	pthread_mutex_t lock;
+};
 
-static const char *relpath = "";
+/* thread-local: each worker thread opens the repository itself */
+static __thread git_repository *repo;
+/* object database of the main thread, shared by all threads */
+static git_odb *odb;
+
+static __thread const char *relpath = "";
+
+/* parent of the last commit diffed by the thread and its tree: the next
+   commit of a run of the log is this parent */
+static __thread git_commit *lastparent;
+static __thread git_tree *lastparenttree;
+/* CPU time and size of the modified files diffed by the thread, to
+   estimate the time of the next diff for -b */
+static __thread long diffms;
+static __thread size_t diffbytes;
 static const char *repodir;
+static git_oid headoid;
 
 static char *name = "";
 static char *strippedname = "";
-static char description[255];
-static char cloneurl[1024];
-static char *submodules;
-static char *licensefiles[] = { "HEAD:LICENSE", "HEAD:LICENSE.md", "HEAD:COPYING" };
+static struct repometa meta;
+static int hasgitmodules;
+static struct submodule *submodules; /* sorted by path */
+static size_t nsubmodules;
+static char *licensefiles[] = { "LICENSE", "LICENSE.md", "COPYING" };
 static char *license;
-static char *readmefiles[] = { "HEAD:README", "HEAD:README.md" };
+static char *readmefiles[] = { "README", "README.md" };
 static char *readme;
 static long long nlogcommits = -1; /* < 0 indicates not used */
+static int syncoutput; /* flush output to disk before updating the cache */
+static int packorder; /* write file pages in the order of the packs */
+static const char *storedir; /* diffs of commits shared between repositories */
+static int fanout; /* commit pages in commit/ab/cdef....html */
+static int patches; /* write commit/<oid>.patch with each commit page */
+static int terse; /* compact markup of lines, deep links by lines.js */
+static int treepages; /* a page per directory in tree/ */
+static long filebudget, commitbudget; /* CPU time of diffs in ms, 0 if none */
+static uint32_t diffalgo; /* GIT_DIFF_PATIENCE or GIT_DIFF_MINIMAL, else Myers */
+static int relayout; /* commit pages of the other layout were removed */
+static int attrglobal; /* attribute files outside the trees */
+static git_oid attrstate; /* hash of the attribute files outside the trees */
+static git_oid pagestate; /* options and metadata of the pages of files */
+
+/* manifest of the output files */
+static const char *manifestfile;
+static struct manifestentry *manifest; /* previous run, sorted by path */
+static size_t nmanifest;
+static struct manifestentry *newentries; /* new files in this run */
+static size_t nnewentries;
+static struct page *pages_open;
+static pthread_mutex_t pagelock = PTHREAD_MUTEX_INITIALIZER;
+
+/* archive: pages appended to one file, the manifest is its index */
+static const char *archivefile;
+static int compact; /* -z: only compact the archive */
+static char archiveindex[PATH_MAX];
+static FILE *archivefp;
+static off_t archiveend;
+
+/* list of the output files created, modified or removed in this run */
+static const char *changesfile;
+static FILE *changesfp;
+static pthread_mutex_t changeslock = PTHREAD_MUTEX_INITIALIZER;
+
+/* commit pages written before or in this run */
+static struct oidset pages;
+static const git_oid zerooid;
+
+/* raw files: blobs stored in this run */
+static int rawfiles;
+static struct oidset blobs;
+static pthread_mutex_t blobslock = PTHREAD_MUTEX_INITIALIZER;
+
+static mode_t mask; /* umask */
 
 /* cache */
 static git_oid lastoid;
@@ -75,16 +276,245 @@ static char lastoidstr[GIT_OID_HEXSZ + 2]; /* id + newline + NUL byte */
 static FILE *rcachefp, *wcachefp;
 static const char *cachefile;
 
+/* scheduler */
+static struct worker *workers;
+static size_t nworkers, nextworker;
+static size_t jobwindow, njobs, jobqueued;
+static struct job *jobhead, *jobtail;
+static int jobquit;
+static pthread_mutex_t joblock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobwork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t jobdone = PTHREAD_COND_INITIALIZER;
+
+/* files read in pack order, rows of files.html kept in tree order */
+static struct pack *packs;
+static size_t npacks;
+static struct packorder *packfiles;
+static size_t npackfiles;
+static struct row *filerows;
+static size_t nfilerows;
+static struct job **treejobs; /* pages of directories, after the rows */
+static size_t ntreejobs;
+
+/* state of the references table being written */
+static size_t refsrows;
+static int refsstop;
+
+/* references cache: the state of the references in the git directory and
+   the commit of each reference, next to the log cache file */
+static struct refcache *refcache;
+static size_t nrefcache;
+static char refsstate[128], refcachestate[128];
+static char refcachefile[PATH_MAX];
+static FILE *wrefsfp;
+
+/* tags in the order of the date of their commit */
+static struct tag *tags;
+static size_t ntags;
+
+/* page or patch of a commit, relative to the top of the output directory */
 void
-joinpath(char *buf, size_t bufsiz, const char *path, const char *path2)
+commitpath(char *buf, size_t bufsiz, const char *oid, const char *ext)
 {
 	int r;
 
-	r = snprintf(buf, bufsiz, "%s%s%s",
-		path, path[0] && path[strlen(path) - 1] != '/' ? "/" : "", path2);
+	if (fanout)
+		r = snprintf(buf, bufsiz, "commit/%.2s/%s%s", oid, oid + 2, ext);
+	else
+		r = snprintf(buf, bufsiz, "commit/%s%s", oid, ext);
 	if (r < 0 || (size_t)r >= bufsiz)
-		errx(1, "path truncated: '%s%s%s'",
-			path, path[0] && path[strlen(path) - 1] != '/' ? "/" : "", path2);
+		errx(1, "path truncated: 'commit/%s%s'", oid, ext);
+}
+
+/* add an output file to the list of changes */
+void
+changed(const char *path)
+{
+	/* the list has a path per line */
+	if (!changesfp || strchr(path, '\n'))
+		return;
+	pthread_mutex_lock(&changeslock);
+	fprintf(changesfp, "%s\n", path);
+	pthread_mutex_unlock(&changeslock);
+}
+
+/* add an object id to the set, 0 if it was in the set already */
+int
+oidset_add(struct oidset *set, const git_oid *id)
+{
+	git_oid *old;
+	size_t i, oldsize;
+	uint64_t h;
+
+	if (set->n + 1 > set->size / 2) {
+		old = set->ids;
+		oldsize = set->size;
+		set->size = set->size ? set->size * 2 : 1024;
+		if (!(set->ids = calloc(set->size, sizeof(*set->ids))))
+			err(1, "calloc");
+		set->n = 0;
+		for (i = 0; i < oldsize; i++)
+			if (memcmp(&old[i], &zerooid, sizeof(zerooid)))
+				oidset_add(set, &old[i]);
+		free(old);
+	}
+
+	/* object ids are uniformly distributed, use them as the hash */
+	memcpy(&h, id->id, sizeof(h));
+	for (i = h & (set->size - 1);
+	     memcmp(&set->ids[i], &zerooid, sizeof(zerooid));
+	     i = (i + 1) & (set->size - 1))
+		if (!git_oid_cmp(&set->ids[i], id))
+			return 0;
+	set->ids[i] = *id;
+	set->n++;
+	return 1;
+}
+
+int
+oidset_has(const struct oidset *set, const git_oid *id)
+{
+	size_t i;
+	uint64_t h;
+
+	if (!set->size)
+		return 0;
+	memcpy(&h, id->id, sizeof(h));
+	for (i = h & (set->size - 1);
+	     memcmp(&set->ids[i], &zerooid, sizeof(zerooid));
+	     i = (i + 1) & (set->size - 1))
+		if (!git_oid_cmp(&set->ids[i], id))
+			return 1;
+	return 0;
+}
+
+/* add a page by its name, prefix is the directory in the fan-out layout */
+void
+pages_addname(const char *prefix, const char *name)
+{
+	git_oid id;
+	char oid[GIT_OID_HEXSZ + 1];
+	size_t len = strlen(name);
+
+	if (len < 5 || strcmp(name + len - 5, ".html") ||
+	    snprintf(oid, sizeof(oid), "%s%.*s", prefix, (int)(len - 5), name) !=
+	    GIT_OID_HEXSZ)
+		return;
+	if (!git_oid_fromstr(&id, oid))
+		oidset_add(&pages, &id);
+}
+
+/* remove a directory of the pages of a large commit */
+void
+removefragments(const char *path)
+{
+	DIR *dp;
+	struct dirent *d;
+	char fpath[PATH_MAX];
+
+	if (!(dp = opendir(path)))
+		err(1, "opendir: '%s'", path);
+	while ((d = readdir(dp))) {
+		if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+			continue;
+		joinpath(fpath, sizeof(fpath), path, d->d_name);
+		if (unlink(fpath))
+			err(1, "unlink: '%s'", fpath);
+		changed(fpath);
+	}
+	closedir(dp);
+	if (rmdir(path))
+		err(1, "rmdir: '%s'", path);
+}
+
+/* enumerate the commit pages once, for all existence checks of the run.
+   The pages and patches of the other layout are removed: their links are
+   relative to another directory depth, so they are written again. Fan-out
+   directories are 2 characters long. */
+int
+scancommits(void)
+{
+	DIR *dp, *sdp;
+	struct dirent *d, *sd;
+	char path[PATH_MAX], spath[PATH_MAX], prefix[3], *p;
+	size_t i, len;
+	int removed = 0;
+
+	/* the pages of an archive are in its index */
+	if (archivefile) {
+		for (i = 0; i < nmanifest; i++) {
+			if (strncmp(manifest[i].path, "commit/", 7))
+				continue;
+			p = manifest[i].path + 7;
+			if (strlen(p) > 3 && p[2] == '/') {
+				if (!fanout) {
+					removed = 1;
+					continue;
+				}
+				memcpy(prefix, p, 2);
+				prefix[2] = '\0';
+				pages_addname(prefix, p + 3);
+			} else {
+				if (fanout) {
+					removed = 1;
+					continue;
+				}
+				pages_addname("", p);
+			}
+		}
+		return removed;
+	}
+
+	if (!(dp = opendir("commit")))
+		return 0;
+	while ((d = readdir(dp))) {
+		len = strlen(d->d_name);
+		joinpath(path, sizeof(path), "commit", d->d_name);
+		if ((len > 5 && !strcmp(d->d_name + len - 5, ".html")) ||
+		    (len > 6 && !strcmp(d->d_name + len - 6, ".patch"))) {
+			if (!fanout) {
+				pages_addname("", d->d_name);
+				continue;
+			}
+			if (unlink(path))
+				err(1, "unlink: '%s'", path);
+			changed(path);
+			removed = 1;
+		} else if (len == GIT_OID_HEXSZ) {
+			/* pages of a large commit */
+			if (fanout) {
+				removefragments(path);
+				removed = 1;
+			}
+		} else if (len == 2 && d->d_name[0] != '.') {
+			if (!(sdp = opendir(path)))
+				continue;
+			while ((sd = readdir(sdp))) {
+				if (fanout) {
+					pages_addname(d->d_name, sd->d_name);
+					continue;
+				}
+				if (!strcmp(sd->d_name, ".") || !strcmp(sd->d_name, ".."))
+					continue;
+				joinpath(spath, sizeof(spath), path, sd->d_name);
+				if (strlen(sd->d_name) == GIT_OID_HEXSZ - 2)
+					removefragments(spath);
+				else if (unlink(spath))
+					err(1, "unlink: '%s'", spath);
+				else
+					changed(spath);
+			}
+			closedir(sdp);
+			if (!fanout) {
+				if (rmdir(path))
+					err(1, "rmdir: '%s'", path);
+				removed = 1;
+			}
+		}
+	}
+	closedir(dp);
+
+	return removed;
 }
 
 void
@@ -97,6 +527,166 @@ deltainfo_free(struct deltainfo *di)
 	free(di);
 }
 
+void
+commitinfo_gettrees(struct commitinfo *ci)
+{
+	if (!ci->commit_tree &&
+	    git_tree_lookup(&(ci->commit_tree), repo, git_commit_tree_id(ci->commit)))
+		return;
+	if (ci->parent)
+		return;
+	if (!git_commit_parent(&(ci->parent), ci->commit, 0)) {
+		if (git_tree_lookup(&(ci->parent_tree), repo, git_commit_tree_id(ci->parent))) {
+			ci->parent = NULL;
+			ci->parent_tree = NULL;
+		}
+	}
+}
+
+/* CPU time of the thread in milliseconds */
+long
+cputime(void)
+{
+	struct timespec ts;
+
+#ifdef CLOCK_THREAD_CPUTIME_ID
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts))
+#endif
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+/* size of a blob without reading its content, 0 if none */
+size_t
+blobsize(const git_oid *id)
+{
+	git_object_t type;
+	size_t len = 0;
+
+	if (git_odb_read_header(&len, &type, odb, id))
+		len = 0;
+
+	return len;
+}
+
+/* append the path and content of an attribute file, 1 if it exists */
+int
+attrfile(FILE *fp, const char *path)
+{
+	FILE *afp;
+	char buf[BUFSIZ];
+	size_t n;
+
+	if (!(afp = fopen(path, "r")))
+		return 0;
+	fprintf(fp, "%s\n", path);
+	while ((n = fread(buf, 1, sizeof(buf), afp)))
+		fwrite(buf, 1, n, fp);
+	fclose(afp);
+
+	return 1;
+}
+
+/* attribute files outside the trees, which apply to all paths:
+   info/attributes and the global attributes file. hash is the hash of
+   their content */
+int
+globalattrfiles(git_oid *hash)
+{
+	git_config *cfg;
+	git_buf buf = { 0 };
+	FILE *fp;
+	const char *s;
+	char *content = NULL, path[PATH_MAX];
+	size_t len = 0;
+	int found, set = 0;
+
+	if (!(fp = open_memstream(&content, &len)))
+		err(1, "open_memstream");
+	joinpath(path, sizeof(path), git_repository_path(repo), "info/attributes");
+	found = attrfile(fp, path);
+	if (!git_repository_config_snapshot(&cfg, repo)) {
+		set = !git_config_get_path(&buf, cfg, "core.attributesfile");
+		git_config_free(cfg);
+	}
+	if (set) {
+		attrfile(fp, buf.ptr);
+		found = 1;
+	} else if ((s = getenv("XDG_CONFIG_HOME")) && s[0]) {
+		joinpath(path, sizeof(path), s, "git/attributes");
+		found |= attrfile(fp, path);
+	} else if ((s = getenv("HOME"))) {
+		joinpath(path, sizeof(path), s, ".config/git/attributes");
+		found |= attrfile(fp, path);
+	}
+	git_buf_dispose(&buf);
+	if (fclose(fp))
+		err(1, "fclose");
+	if (git_odb_hash(hash, content, len, GIT_OBJ_BLOB))
+		errx(1, "hash: attributes");
+	free(content);
+
+	return found;
+}
+
+/* attribute files can apply to the paths in the directory of the first
+   len bytes of path in tree: a .gitattributes in it or above */
+int
+dirattrfiles(git_tree *tree, const char *path, size_t len)
+{
+	git_tree_entry *e;
+	char attrpath[PATH_MAX];
+	size_t i;
+
+	if (attrglobal || git_tree_entry_byname(tree, ".gitattributes"))
+		return 1;
+	for (i = 1; i <= len; i++) {
+		if (i < len && path[i] != '/')
+			continue;
+		if (snprintf(attrpath, sizeof(attrpath), "%.*s/.gitattributes",
+		    (int)i, path) >= (int)sizeof(attrpath))
+			return 1;
+		if (!git_tree_entry_bypath(&e, tree, attrpath)) {
+			git_tree_entry_free(e);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* the diff of a path is not shown when it is marked -diff, binary or
+   linguist-generated in the .gitattributes of the commit */
+int
+pathattr(const git_oid *commit, const char *path)
+{
+	git_attr_options opts;
+	const char *names[] = { "diff", "linguist-generated" }, *values[2];
+
+	memset(&opts, 0, sizeof(opts));
+	opts.version = GIT_ATTR_OPTIONS_VERSION;
+	opts.flags = GIT_ATTR_CHECK_INDEX_ONLY | GIT_ATTR_CHECK_NO_SYSTEM |
+	             GIT_ATTR_CHECK_INCLUDE_COMMIT;
+	opts.attr_commit_id = *commit;
+	if (git_attr_get_many_ext(values, repo, &opts, path, 2, names))
+		return 0;
+	if (GIT_ATTR_IS_FALSE(values[0]))
+		return ATTR_BINARY;
+	if (GIT_ATTR_IS_TRUE(values[1]) ||
+	    (values[1] && !strcmp(values[1], "true")))
+		return ATTR_GENERATED;
+	return 0;
+}
+
+/* the diff of too large commits is split over pages */
+int
+commitlarge(struct commitinfo *ci)
+{
+	return ci->filecount > 1000   ||
+	       ci->ndeltas   > 1000   ||
+	       ci->addcount  > 100000 ||
+	       ci->delcount  > 100000;
+}
+
 int
 commitinfo_getstats(struct commitinfo *ci)
 {
@@ -107,22 +697,20 @@ commitinfo_getstats(struct commitinfo *ci)
 	const git_diff_hunk *hunk;
 	const git_diff_line *line;
 	git_patch *patch = NULL;
-	size_t ndeltas, nhunks, nhunklines;
+	const char *path, *p, *dir = NULL;
+	size_t ndeltas, nhunks, nhunklines, len, dirlen = 0, size = 0;
 	size_t i, j, k;
+	long start, t;
+	int attr, attrs = 0, large = 0;
 
-	if (git_tree_lookup(&(ci->commit_tree), repo, git_commit_tree_id(ci->commit)))
+	commitinfo_gettrees(ci);
+	if (!ci->commit_tree)
 		goto err;
-	if (!git_commit_parent(&(ci->parent), ci->commit, 0)) {
-		if (git_tree_lookup(&(ci->parent_tree), repo, git_commit_tree_id(ci->parent))) {
-			ci->parent = NULL;
-			ci->parent_tree = NULL;
-		}
-	}
 
 	git_diff_init_options(&opts, GIT_DIFF_OPTIONS_VERSION);
 	opts.flags |= GIT_DIFF_DISABLE_PATHSPEC_MATCH |
 	              GIT_DIFF_IGNORE_SUBMODULES |
-		      GIT_DIFF_INCLUDE_TYPECHANGE;
+		      GIT_DIFF_INCLUDE_TYPECHANGE | diffalgo;
 	if (git_diff_tree_to_tree(&(ci->diff), repo, ci->parent_tree, ci->commit_tree, &opts))
 		goto err;
 
@@ -137,23 +725,83 @@ commitinfo_getstats(struct commitinfo *ci)
 	ndeltas = git_diff_num_deltas(ci->diff);
 	if (ndeltas && !(ci->deltas = calloc(ndeltas, sizeof(struct deltainfo *))))
 		err(1, "calloc");
+	ci->ndeltas = ndeltas;
+	ci->filecount = ndeltas;
 
+	start = cputime();
 	for (i = 0; i < ndeltas; i++) {
-		if (git_patch_from_diff(&patch, ci->diff, i))
-			goto err;
-
 		if (!(di = calloc(1, sizeof(struct deltainfo))))
 			err(1, "calloc");
-		di->patch = patch;
 		ci->deltas[i] = di;
+		di->delta = git_diff_get_delta(ci->diff, i);
+
+		/* the attribute files of a directory are looked up once for its
+		   paths, the deltas are sorted by path */
+		path = di->delta->new_file.path;
+		len = (p = strrchr(path, '/')) ? (size_t)(p - path) : 0;
+		if (!dir || len != dirlen || strncmp(path, dir, len)) {
+			dir = path;
+			dirlen = len;
+			attrs = dirattrfiles(ci->commit_tree, dir, dirlen);
+		}
 
-		delta = git_patch_get_delta(patch);
+		/* opaque files are counted, but not diffed */
+		if (attrs && (attr = pathattr(ci->id, path))) {
+			di->suppressed = attr == ATTR_BINARY ?
+			    "Binary files differ." :
+			    "Generated file, output suppressed.";
+			continue;
+		}
 
-		/* skip stats for binary data */
-		if (delta->flags & GIT_DIFF_FLAG_BINARY)
+		/* only the diff of modified files can be expensive: they are
+		   not diffed after the budget of the commit is used */
+		if (commitbudget && di->delta->status == GIT_DELTA_MODIFIED &&
+		    cputime() - start > commitbudget) {
+			di->suppressed = "Diff is too expensive, output suppressed.";
+			ci->overbudget = 1;
+			continue;
+		}
+
+		/* a diff cannot be interrupted: its time is estimated from
+		   the size of the file and the time per byte of the diffs
+		   before it */
+		if (filebudget && di->delta->status == GIT_DELTA_MODIFIED) {
+			size = blobsize(&(di->delta->old_file.id)) +
+			       blobsize(&(di->delta->new_file.id));
+			if (diffbytes &&
+			    (double)diffms / diffbytes * size > filebudget) {
+				di->suppressed = "Diff is too expensive, output suppressed.";
+				ci->overbudget = 1;
+				continue;
+			}
+		}
+
+		t = cputime();
+		if (git_patch_from_diff(&patch, ci->diff, i))
+			goto err;
+		di->patch = patch;
+		di->delta = delta = git_patch_get_delta(patch);
+		if (filebudget && delta->status == GIT_DELTA_MODIFIED) {
+			diffms += cputime() - t;
+			diffbytes += size;
+		}
+
+		/* a diff which took longer than estimated is not shown */
+		if (filebudget && delta->status == GIT_DELTA_MODIFIED &&
+		    cputime() - t > filebudget) {
+			git_patch_free(patch);
+			di->patch = NULL;
+			di->suppressed = "Diff is too expensive, output suppressed.";
+			ci->overbudget = 1;
 			continue;
+		}
+
+		/* no stats for binary data */
+		if (delta->flags & GIT_DIFF_FLAG_BINARY)
+			nhunks = 0;
+		else
+			nhunks = git_patch_num_hunks(patch);
 
-		nhunks = git_patch_num_hunks(patch);
 		for (j = 0; j < nhunks; j++) {
 			if (git_patch_get_hunk(&hunk, &nhunklines, patch, j))
 				break;
@@ -169,9 +817,20 @@ commitinfo_getstats(struct commitinfo *ci)
 				}
 			}
 		}
+
+		/* the patches of a large commit are not kept, they are made
+		   again for each page of its diff */
+		if (!large && (large = commitlarge(ci))) {
+			for (j = 0; j < i; j++) {
+				git_patch_free(ci->deltas[j]->patch);
+				ci->deltas[j]->patch = NULL;
+			}
+		}
+		if (large) {
+			git_patch_free(patch);
+			di->patch = NULL;
+		}
 	}
-	ci->ndeltas = i;
-	ci->filecount = i;
 
 	return 0;
 
@@ -194,10 +853,24 @@ err:
 	ci->addcount = 0;
 	ci->delcount = 0;
 	ci->filecount = 0;
+	ci->overbudget = 0;
 
 	return -1;
 }
 
+/* keep the parent of the commit and its tree for the next commit of the
+   thread */
+void
+commitinfo_keepparent(struct commitinfo *ci)
+{
+	git_commit_free(lastparent);
+	git_tree_free(lastparenttree);
+	lastparent = ci->parent;
+	lastparenttree = ci->parent_tree;
+	ci->parent = NULL;
+	ci->parent_tree = NULL;
+}
+
 void
 commitinfo_free(struct commitinfo *ci)
 {
@@ -227,9 +900,17 @@ commitinfo_getbyoid(const git_oid *id)
 	if (!(ci = calloc(1, sizeof(struct commitinfo))))
 		err(1, "calloc");
 
-	if (git_commit_lookup(&(ci->commit), repo, id))
+	/* the parent of the last commit of the thread and its tree are
+	   already read */
+	if (lastparent && !git_oid_cmp(git_commit_id(lastparent), id)) {
+		ci->commit = lastparent;
+		ci->commit_tree = lastparenttree;
+		lastparent = NULL;
+		lastparenttree = NULL;
+	} else if (git_commit_lookup(&(ci->commit), repo, id)) {
 		goto err;
-	ci->id = id;
+	}
+	ci->id = git_commit_id(ci->commit);
 
 	git_oid_tostr(ci->oid, sizeof(ci->oid), git_commit_id(ci->commit));
 	git_oid_tostr(ci->parentoid, sizeof(ci->parentoid), git_commit_parent_id(ci->commit, 0));
@@ -258,105 +939,720 @@ efopen(const char *name, const char *flags)
 	return fp;
 }
 
-/* Escape characters below as HTML 2.0 / XML 1.0. */
+int
+manifest_cmp(const void *v1, const void *v2)
+{
+	return strcmp(((struct manifestentry *)v1)->path,
+	              ((struct manifestentry *)v2)->path);
+}
+
+/* read the manifest of the previous run (does not need to exist), a line
+   per output file: content hash, source object id and path. The index of
+   an archive has the offset and length of the content before the path */
 void
-xmlencode(FILE *fp, const char *s, size_t len)
+manifest_read(void)
 {
-	size_t i;
+	struct manifestentry *e;
+	FILE *fp;
+	char *line = NULL, hash[GIT_OID_HEXSZ + 1], source[GIT_OID_HEXSZ + 1];
+	size_t linesiz = 0;
+	long long offset = 0, len = 0;
+	int n;
 
-	for (i = 0; *s && i < len; s++, i++) {
-		switch(*s) {
-		case '<':  fputs("&lt;",   fp); break;
-		case '>':  fputs("&gt;",   fp); break;
-		case '\'': fputs("&#39;",  fp); break;
-		case '&':  fputs("&amp;",  fp); break;
-		case '"':  fputs("&quot;", fp); break;
-		default:   fputc(*s, fp);
-		}
+	if (!(fp = fopen(manifestfile, "r")))
+		return;
+	while (getline(&line, &linesiz, fp) > 0) {
+		line[strcspn(line, "\n")] = '\0';
+		if ((archivefile ?
+		    sscanf(line, "%40s %40s %lld %lld %n", hash, source,
+		           &offset, &len, &n) != 4 :
+		    sscanf(line, "%40s %40s %n", hash, source, &n) != 2) ||
+		    !line[n] || offset < 0 || len < 0)
+			errx(1, "%s: invalid line", manifestfile);
+
+		if (!(manifest = reallocarray(manifest, nmanifest + 1, sizeof(*manifest))))
+			err(1, "realloc");
+		e = &manifest[nmanifest];
+		memset(e, 0, sizeof(*e));
+		if (git_oid_fromstr(&(e->hash), hash) ||
+		    git_oid_fromstr(&(e->source), source))
+			errx(1, "%s: invalid object id", manifestfile);
+		if (!(e->path = strdup(line + n)))
+			err(1, "strdup");
+		e->offset = (off_t)offset;
+		e->len = (size_t)len;
+		nmanifest++;
 	}
+	free(line);
+	fclose(fp);
+
+	qsort(manifest, nmanifest, sizeof(*manifest), manifest_cmp);
 }
 
-int
-mkdirp(const char *path)
+/* entry of the previous run, NULL if none */
+struct manifestentry *
+manifest_find(const char *path)
 {
-	char tmp[PATH_MAX], *p;
+	struct manifestentry key;
 
-	if (strlcpy(tmp, path, sizeof(tmp)) >= sizeof(tmp))
-		errx(1, "path truncated: '%s'", path);
-	for (p = tmp + (tmp[0] == '/'); *p; p++) {
-		if (*p != '/')
-			continue;
-		*p = '\0';
-		if (mkdir(tmp, S_IRWXU | S_IRWXG | S_IRWXO) < 0 && errno != EEXIST)
-			return -1;
-		*p = '/';
-	}
-	if (mkdir(tmp, S_IRWXU | S_IRWXG | S_IRWXO) < 0 && errno != EEXIST)
-		return -1;
-	return 0;
+	key.path = (char *)path;
+	return bsearch(&key, manifest, nmanifest, sizeof(*manifest), manifest_cmp);
 }
 
+/* output file which is not written again in this run, but is still valid */
 void
-printtimez(FILE *fp, const git_time *intime)
+manifest_keep(const char *path)
 {
-	struct tm *intm;
-	time_t t;
-	char out[32];
+	struct manifestentry *e;
 
-	t = (time_t)intime->time;
-	if (!(intm = gmtime(&t)))
-		return;
-	strftime(out, sizeof(out), "%Y-%m-%dT%H:%M:%SZ", intm);
-	fputs(out, fp);
+	if (manifestfile && (e = manifest_find(path)))
+		e->seen = 1;
 }
 
-void
-printtime(FILE *fp, const git_time *intime)
+/* index of the first entry of the previous run not before path */
+size_t
+manifest_lower(const char *path)
 {
-	struct tm *intm;
-	time_t t;
-	char out[32];
+	size_t lo = 0, hi = nmanifest, mid;
 
-	t = (time_t)intime->time + (intime->offset * 60);
-	if (!(intm = gmtime(&t)))
-		return;
-	strftime(out, sizeof(out), "%a, %e %b %Y %H:%M:%S", intm);
-	if (intime->offset < 0)
-		fprintf(fp, "%s -%02d%02d", out,
-		            -(intime->offset) / 60, -(intime->offset) % 60);
-	else
-		fprintf(fp, "%s +%02d%02d", out,
-		            intime->offset / 60, intime->offset % 60);
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strcmp(manifest[mid].path, path) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
 }
 
+/* keep all the files of the previous run in a directory */
 void
-printtimeshort(FILE *fp, const git_time *intime)
+manifest_keepdir(const char *dir)
 {
-	struct tm *intm;
-	time_t t;
-	char out[32];
+	size_t i, len = strlen(dir);
 
-	t = (time_t)intime->time;
-	if (!(intm = gmtime(&t)))
-		return;
-	strftime(out, sizeof(out), "%Y-%m-%d %H:%M", intm);
-	fputs(out, fp);
+	for (i = manifest_lower(dir);
+	     i < nmanifest && !strncmp(manifest[i].path, dir, len); i++)
+		manifest[i].seen = 1;
 }
 
-void
-writeheader(FILE *fp, const char *title)
+/* record a written output file, 1 if its content changed. In an archive
+   the changed content is appended */
+int
+manifest_update(const char *path, const git_oid *hash, const git_oid *source,
+                const char *buf, size_t len)
 {
-	fputs("<!DOCTYPE html>\n"
-		"<html>\n<head>\n"
-		"<meta http-equiv=\"Content-Type\" content=\"text/html; charset=UTF-8\" />\n"
-		"<title>", fp);
-	xmlencode(fp, title, strlen(title));
-	if (title[0] && strippedname[0])
-		fputs(" - ", fp);
+	struct manifestentry *e;
+	int changed = 1;
+
+	pthread_mutex_lock(&pagelock);
+	if ((e = manifest_find(path))) {
+		changed = git_oid_cmp(&(e->hash), hash) != 0;
+	} else {
+		if (!(newentries = reallocarray(newentries, nnewentries + 1,
+		    sizeof(*newentries))))
+			err(1, "realloc");
+		e = &newentries[nnewentries++];
+		if (!(e->path = strdup(path)))
+			err(1, "strdup");
+	}
+	e->hash = *hash;
+	e->source = *source;
+	e->seen = 1;
+	if (archivefp && changed) {
+		if (fwrite(buf, 1, len, archivefp) != len)
+			err(1, "fwrite: '%s'", archivefile);
+		e->offset = archiveend;
+		e->len = len;
+		archiveend += len;
+	}
+	pthread_mutex_unlock(&pagelock);
+
+	return changed;
+}
+
+/* remove the output files of the previous run which were not written or
+   kept in this run, and the directories they leave empty */
+void
+manifest_sweep(void)
+{
+	char dir[PATH_MAX], *p;
+	size_t i;
+
+	for (i = 0; i < nmanifest; i++) {
+		if (manifest[i].seen)
+			continue;
+		/* only removed from the index of an archive */
+		if (archivefile) {
+			changed(manifest[i].path);
+			continue;
+		}
+		if (!unlink(manifest[i].path))
+			changed(manifest[i].path);
+		else if (errno != ENOENT)
+			err(1, "unlink: '%s'", manifest[i].path);
+		strlcpy(dir, manifest[i].path, sizeof(dir));
+		while ((p = strrchr(dir, '/'))) {
+			*p = '\0';
+			if (rmdir(dir))
+				break;
+		}
+	}
+}
+
+/* write the new manifest: the files of this run and the kept files */
+void
+manifest_write(char *tmppath)
+{
+	struct manifestentry *all;
+	FILE *fp;
+	char hash[GIT_OID_HEXSZ + 1], source[GIT_OID_HEXSZ + 1];
+	size_t i, n;
+	int fd;
+
+	if (!(all = reallocarray(NULL, nmanifest + nnewentries + 1, sizeof(*all))))
+		err(1, "realloc");
+	for (i = n = 0; i < nmanifest; i++)
+		if (manifest[i].seen)
+			all[n++] = manifest[i];
+	for (i = 0; i < nnewentries; i++)
+		all[n++] = newentries[i];
+	qsort(all, n, sizeof(*all), manifest_cmp);
+
+	if ((fd = mkstemp(tmppath)) == -1)
+		err(1, "mkstemp");
+	if (!(fp = fdopen(fd, "w")))
+		err(1, "fdopen: '%s'", tmppath);
+	for (i = 0; i < n; i++) {
+		git_oid_tostr(hash, sizeof(hash), &(all[i].hash));
+		git_oid_tostr(source, sizeof(source), &(all[i].source));
+		if (archivefile)
+			fprintf(fp, "%s %s %lld %zu %s\n", hash, source,
+			        (long long)all[i].offset, all[i].len, all[i].path);
+		else
+			fprintf(fp, "%s %s %s\n", hash, source, all[i].path);
+	}
+	if (fclose(fp))
+		err(1, "fclose: '%s'", tmppath);
+	free(all);
+}
+
+void
+manifest_free(void)
+{
+	size_t i;
+
+	for (i = 0; i < nmanifest; i++)
+		free(manifest[i].path);
+	for (i = 0; i < nnewentries; i++)
+		free(newentries[i].path);
+	free(manifest);
+	free(newentries);
+}
+
+/* a precompressed member path.gz of an archive: the raw files in raw/
+   have any name and are not compressed */
+int
+gzmember(const char *path)
+{
+	size_t len = strlen(path);
+
+	return len > 3 && !strcmp(path + len - 3, ".gz") &&
+	       strncmp(path, "raw/", 4);
+}
+
+/* the page of a precompressed member, NULL if the member is not of the
+   current content of its page */
+struct manifestentry *
+gzpage(struct manifestentry *gz)
+{
+	struct manifestentry *e;
+	char path[PATH_MAX];
+	size_t len = strlen(gz->path);
+
+	if (!gzmember(gz->path) || len - 3 >= sizeof(path))
+		return NULL;
+	memcpy(path, gz->path, len - 3);
+	path[len - 3] = '\0';
+	if (!(e = manifest_find(path)) || git_oid_cmp(&(e->hash), &(gz->source)))
+		return NULL;
+	return e;
+}
+
+/* keep the precompressed members of the pages which did not change */
+void
+manifest_keepgz(void)
+{
+	struct manifestentry *e;
+	size_t i;
+
+	for (i = 0; i < nmanifest; i++)
+		if (!manifest[i].seen && (e = gzpage(&manifest[i])) && e->seen)
+			manifest[i].seen = 1;
+}
+
+/* gzip member of a page, 0 if it is not smaller than the page */
+size_t
+gzipbuf(const char *buf, size_t len, char **out)
+{
+	z_stream zs;
+	size_t n;
+
+	memset(&zs, 0, sizeof(zs));
+	/* a gzip header without a modification time */
+	if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+	    Z_DEFAULT_STRATEGY) != Z_OK)
+		errx(1, "deflateInit2");
+	n = deflateBound(&zs, len);
+	if (!(*out = malloc(n)))
+		err(1, "malloc");
+	zs.next_in = (unsigned char *)buf;
+	zs.avail_in = len;
+	zs.next_out = (unsigned char *)*out;
+	zs.avail_out = n;
+	if (deflate(&zs, Z_FINISH) != Z_STREAM_END)
+		errx(1, "deflate");
+	n = zs.total_out;
+	deflateEnd(&zs);
+
+	return n < len ? n : 0;
+}
+
+/* offline step for -z: copy the current pages of the archive to a new
+   archive in the order of their paths, with a member path.gz for each HTML
+   page and feed which has none yet */
+void
+archive_compact(char *tmppath, char *indextmppath)
+{
+	struct manifestentry *e, *gz;
+	FILE *fp;
+	char *buf = NULL, *zbuf, path[PATH_MAX];
+	size_t bufsiz = 0, i, zlen;
+	off_t offset = 0;
+	int fd, rfd;
+
+	manifest_read();
+	if ((rfd = open(archivefile, O_RDONLY)) == -1)
+		err(1, "open: '%s'", archivefile);
+	if ((fd = mkstemp(tmppath)) == -1)
+		err(1, "mkstemp");
+	if (!(fp = fdopen(fd, "w")))
+		err(1, "fdopen: '%s'", tmppath);
+
+	for (i = 0; i < nmanifest; i++) {
+		e = &manifest[i];
+		/* members of an older content of their page are removed */
+		if (gzmember(e->path) && !gzpage(e))
+			continue;
+		e->seen = 1;
+		if (e->len > bufsiz) {
+			bufsiz = e->len;
+			if (!(buf = realloc(buf, bufsiz)))
+				err(1, "realloc");
+		}
+		if (pread(rfd, buf, e->len, e->offset) != (ssize_t)e->len)
+			errx(1, "%s: cannot read '%s'", archivefile, e->path);
+		if (fwrite(buf, 1, e->len, fp) != e->len)
+			err(1, "fwrite: '%s'", tmppath);
+		e->offset = offset;
+		offset += e->len;
+
+		if (!strncmp(e->path, "raw/", 4) ||
+		    ((strlen(e->path) < 5 ||
+		    strcmp(e->path + strlen(e->path) - 5, ".html")) &&
+		    strcmp(e->path, "atom.xml")))
+			continue;
+		if (snprintf(path, sizeof(path), "%s.gz", e->path) >=
+		    (int)sizeof(path) ||
+		    ((gz = manifest_find(path)) && gzpage(gz)))
+			continue;
+		if (!(zlen = gzipbuf(buf, e->len, &zbuf))) {
+			free(zbuf);
+			continue;
+		}
+		if (fwrite(zbuf, 1, zlen, fp) != zlen)
+			err(1, "fwrite: '%s'", tmppath);
+		if (!(newentries = reallocarray(newentries, nnewentries + 1,
+		    sizeof(*newentries))))
+			err(1, "realloc");
+		gz = &newentries[nnewentries++];
+		memset(gz, 0, sizeof(*gz));
+		if (!(gz->path = strdup(path)))
+			err(1, "strdup");
+		if (git_odb_hash(&(gz->hash), zbuf, zlen, GIT_OBJ_BLOB))
+			errx(1, "hash: '%s'", path);
+		/* the source of a member is the content hash of its page */
+		gz->source = e->hash;
+		gz->offset = offset;
+		gz->len = zlen;
+		gz->seen = 1;
+		offset += zlen;
+		free(zbuf);
+	}
+	if (fclose(fp))
+		err(1, "fclose: '%s'", tmppath);
+	close(rfd);
+	free(buf);
+
+	manifest_write(indextmppath);
+	manifest_free();
+
+	/* the archive first: the new index refers to it */
+	if (rename(tmppath, archivefile))
+		err(1, "rename: '%s' to '%s'", tmppath, archivefile);
+	if (chmod(archivefile,
+	    (S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH) & ~mask))
+		err(1, "chmod: '%s'", archivefile);
+	if (rename(indextmppath, archiveindex))
+		err(1, "rename: '%s' to '%s'", indextmppath, archiveindex);
+	if (chmod(archiveindex,
+	    (S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH) & ~mask))
+		err(1, "chmod: '%s'", archiveindex);
+}
+
+/* output page exists from a previous run */
+int
+pageexists(const char *path)
+{
+	if (archivefile)
+		return manifest_find(path) != NULL;
+	return !access(path, F_OK);
+}
+
+/* open an output page made from the object source. With a manifest the
+   page is kept in memory, it is only written if its content changed */
+FILE *
+pageopen(const char *path, const git_oid *source)
+{
+	struct page *pg;
+
+	if (!manifestfile && !changesfile)
+		return efopen(path, "w");
+
+	if (!(pg = calloc(1, sizeof(*pg))))
+		err(1, "calloc");
+	if (strlcpy(pg->path, path, sizeof(pg->path)) >= sizeof(pg->path))
+		errx(1, "path truncated: '%s'", path);
+	if (source)
+		pg->source = *source;
+	if (!(pg->fp = open_memstream(&(pg->buf), &(pg->len))))
+		err(1, "open_memstream");
+
+	pthread_mutex_lock(&pagelock);
+	pg->next = pages_open;
+	pages_open = pg;
+	pthread_mutex_unlock(&pagelock);
+
+	return pg->fp;
+}
+
+void
+pageclose(FILE *fp)
+{
+	struct page *pg, **pp;
+	git_oid hash;
+	FILE *out;
+	int modified;
+
+	if (!manifestfile && !changesfile) {
+		fclose(fp);
+		return;
+	}
+
+	pthread_mutex_lock(&pagelock);
+	for (pp = &pages_open; *pp && (*pp)->fp != fp; pp = &((*pp)->next))
+		;
+	if (!(pg = *pp))
+		errx(1, "pageclose: unknown page");
+	*pp = pg->next;
+	pthread_mutex_unlock(&pagelock);
+
+	if (fclose(pg->fp))
+		err(1, "fclose: '%s'", pg->path);
+	if (manifestfile &&
+	    git_odb_hash(&hash, pg->buf, pg->len, GIT_OBJ_BLOB))
+		errx(1, "hash: '%s'", pg->path);
+
+	/* paths with a newline cannot be in the manifest: always written,
+	   not at all in an archive */
+	if (strchr(pg->path, '\n'))
+		modified = !archivefile;
+	else if (!manifestfile)
+		modified = 1;
+	else
+		modified = manifest_update(pg->path, &hash, &(pg->source),
+		                           pg->buf, pg->len);
+	/* the same content, but the file was removed since the last run */
+	if (!modified && !archivefile && !pageexists(pg->path))
+		modified = 1;
+
+	if (modified && !archivefile) {
+		out = efopen(pg->path, "w");
+		if (fwrite(pg->buf, 1, pg->len, out) != pg->len || fclose(out))
+			err(1, "fwrite: '%s'", pg->path);
+	}
+	if (modified)
+		changed(pg->path);
+	free(pg->buf);
+	free(pg);
+}
+
+int
+mkdirp(const char *path)
+{
+	char tmp[PATH_MAX], *p;
+
+	if (strlcpy(tmp, path, sizeof(tmp)) >= sizeof(tmp))
+		errx(1, "path truncated: '%s'", path);
+	for (p = tmp + (tmp[0] == '/'); *p; p++) {
+		if (*p != '/')
+			continue;
+		*p = '\0';
+		if (mkdir(tmp, S_IRWXU | S_IRWXG | S_IRWXO) < 0 && errno != EEXIST)
+			return -1;
+		*p = '/';
+	}
+	if (mkdir(tmp, S_IRWXU | S_IRWXG | S_IRWXO) < 0 && errno != EEXIST)
+		return -1;
+	return 0;
+}
+
+/* create the directory of an output page, pages in an archive have none */
+int
+pagedir(const char *path)
+{
+	char tmp[PATH_MAX], *d;
+
+	if (archivefile)
+		return 0;
+	if (strlcpy(tmp, path, sizeof(tmp)) >= sizeof(tmp))
+		errx(1, "path truncated: '%s'", path);
+	if (!(d = dirname(tmp)))
+		err(1, "dirname");
+	return mkdirp(d);
+}
+
+/* Flush all written output to disk at once: syncfs(2) only syncs the
+   filesystem of the output directory, elsewhere fallback to sync(2). */
+void
+syncfiles(void)
+{
+#if defined(__linux__) && defined(SYS_syncfs)
+	int fd;
+
+	if ((fd = open(".", O_RDONLY)) == -1)
+		err(1, "open: '.'");
+	if (syscall(SYS_syncfs, fd) == -1)
+		err(1, "syncfs");
+	close(fd);
+#else
+	sync();
+#endif
+}
+
+/* fsync the directory containing path, so a rename(2) in it is durable */
+void
+syncparentdir(const char *path)
+{
+	char tmp[PATH_MAX], *d;
+	int fd;
+
+	if (strlcpy(tmp, path, sizeof(tmp)) >= sizeof(tmp))
+		errx(1, "path truncated: '%s'", path);
+	if (!(d = dirname(tmp)))
+		err(1, "dirname");
+	if ((fd = open(d, O_RDONLY)) == -1)
+		err(1, "open: '%s'", d);
+	if (fsync(fd) == -1 && errno != EINVAL)
+		err(1, "fsync: '%s'", d);
+	close(fd);
+}
+
+int
+submodule_cmp(const void *v1, const void *v2)
+{
+	return strcmp(((struct submodule *)v1)->path,
+	              ((struct submodule *)v2)->path);
+}
+
+/* parse .gitmodules once with the config parser of libgit2: the path and
+   url of each submodule section */
+void
+readgitmodules(const git_tree_entry *entry)
+{
+	git_object *obj = NULL;
+	git_config *cfg = NULL, *snap = NULL;
+	git_config_iterator *it = NULL;
+	git_config_entry *ce;
+	struct submodule *sm;
+	FILE *fp;
+	const char *name, *key;
+	char tmppath[64] = "gitmodules.XXXXXXXXXXXX", **value;
+	size_t len, i, n;
+	int fd, r;
+
+	if (git_tree_entry_to_object(&obj, repo, entry))
+		return;
+	/* libgit2 reads configuration from files only */
+	if ((fd = mkstemp(tmppath)) == -1)
+		err(1, "mkstemp");
+	if (!(fp = fdopen(fd, "w")))
+		err(1, "fdopen: '%s'", tmppath);
+	len = git_blob_rawsize((git_blob *)obj);
+	if (fwrite(git_blob_rawcontent((git_blob *)obj), 1, len, fp) != len ||
+	    fclose(fp))
+		err(1, "fwrite: '%s'", tmppath);
+	git_object_free(obj);
+	r = git_config_open_ondisk(&cfg, tmppath) ||
+	    git_config_snapshot(&snap, cfg);
+	git_config_free(cfg);
+	if (unlink(tmppath))
+		err(1, "unlink: '%s'", tmppath);
+	if (r || git_config_iterator_glob_new(&it, snap,
+	    "^submodule\\..*\\.(path|url)$"))
+		goto err;
+
+	while (!git_config_next(&ce, it)) {
+		/* submodule.<name>.path, the name can contain dots */
+		name = ce->name + strlen("submodule.");
+		key = strrchr(ce->name, '.') + 1;
+		len = key - 1 - name;
+		for (i = 0; i < nsubmodules; i++)
+			if (!strncmp(submodules[i].name, name, len) &&
+			    !submodules[i].name[len])
+				break;
+		if (i == nsubmodules) {
+			if (!(submodules = reallocarray(submodules,
+			    nsubmodules + 1, sizeof(*submodules))))
+				err(1, "realloc");
+			sm = &submodules[nsubmodules++];
+			memset(sm, 0, sizeof(*sm));
+			if (!(sm->name = strndup(name, len)))
+				err(1, "strndup");
+		}
+		sm = &submodules[i];
+		/* the last value of a key is used, as by git */
+		value = strcmp(key, "path") ? &(sm->url) : &(sm->path);
+		free(*value);
+		if (!(*value = strdup(ce->value ? ce->value : "")))
+			err(1, "strdup");
+	}
+err:
+	git_config_iterator_free(it);
+	git_config_free(snap);
+
+	/* sections without a path are not submodules */
+	for (i = n = 0; i < nsubmodules; i++) {
+		if (submodules[i].path) {
+			submodules[n++] = submodules[i];
+		} else {
+			free(submodules[i].name);
+			free(submodules[i].url);
+		}
+	}
+	nsubmodules = n;
+	qsort(submodules, nsubmodules, sizeof(*submodules), submodule_cmp);
+}
+
+/* find README, LICENSE and submodules in one scan of the tree of HEAD */
+void
+findspecialfiles(git_tree *tree)
+{
+	const git_tree_entry *entry;
+	const char *entryname;
+	size_t count, i, j, nlicense, nreadme;
+
+	nlicense = sizeof(licensefiles) / sizeof(*licensefiles);
+	nreadme = sizeof(readmefiles) / sizeof(*readmefiles);
+
+	count = git_tree_entrycount(tree);
+	for (i = 0; i < count; i++) {
+		if (!(entry = git_tree_entry_byindex(tree, i)) ||
+		    git_tree_entry_type(entry) != GIT_OBJ_BLOB ||
+		    !(entryname = git_tree_entry_name(entry)))
+			continue;
+
+		/* the first name in the list has priority */
+		for (j = 0; j < nlicense; j++) {
+			if (!strcmp(entryname, licensefiles[j])) {
+				nlicense = j;
+				license = licensefiles[j];
+			}
+		}
+		for (j = 0; j < nreadme; j++) {
+			if (!strcmp(entryname, readmefiles[j])) {
+				nreadme = j;
+				readme = readmefiles[j];
+			}
+		}
+		if (!strcmp(entryname, ".gitmodules")) {
+			hasgitmodules = 1;
+			readgitmodules(entry);
+		}
+	}
+}
+
+void
+printtimez(FILE *fp, const git_time *intime)
+{
+	struct tm tm, *intm;
+	time_t t;
+	char out[32];
+
+	t = (time_t)intime->time;
+	if (!(intm = gmtime_r(&t, &tm)))
+		return;
+	strftime(out, sizeof(out), "%Y-%m-%dT%H:%M:%SZ", intm);
+	fputs(out, fp);
+}
+
+void
+printtime(FILE *fp, const git_time *intime)
+{
+	struct tm tm, *intm;
+	time_t t;
+	char out[32];
+
+	t = (time_t)intime->time + (intime->offset * 60);
+	if (!(intm = gmtime_r(&t, &tm)))
+		return;
+	strftime(out, sizeof(out), "%a, %e %b %Y %H:%M:%S", intm);
+	if (intime->offset < 0)
+		fprintf(fp, "%s -%02d%02d", out,
+		            -(intime->offset) / 60, -(intime->offset) % 60);
+	else
+		fprintf(fp, "%s +%02d%02d", out,
+		            intime->offset / 60, intime->offset % 60);
+}
+
+void
+printtimeshort(FILE *fp, const git_time *intime)
+{
+	struct tm tm, *intm;
+	time_t t;
+	char out[32];
+
+	t = (time_t)intime->time;
+	if (!(intm = gmtime_r(&t, &tm)))
+		return;
+	strftime(out, sizeof(out), "%Y-%m-%d %H:%M", intm);
+	fputs(out, fp);
+}
+
+void
+writeheader(FILE *fp, const char *title)
+{
+	fputs("<!DOCTYPE html>\n"
+		"<html>\n<head>\n"
+		"<meta http-equiv=\"Content-Type\" content=\"text/html; charset=UTF-8\" />\n"
+		"<title>", fp);
+	xmlencode(fp, title, strlen(title));
+	if (title[0] && strippedname[0])
+		fputs(" - ", fp);
 	xmlencode(fp, strippedname, strlen(strippedname));
-	if (description[0])
+	if (meta.description[0])
 		fputs(" - ", fp);
-	xmlencode(fp, description, strlen(description));
+	xmlencode(fp, meta.description, strlen(meta.description));
 	fprintf(fp, "</title>\n<link rel=\"icon\" type=\"image/png\" href=\"%sfavicon.png\" />\n", relpath);
 	fprintf(fp, "<link rel=\"alternate\" type=\"application/atom+xml\" title=\"%s Atom Feed\" href=\"%satom.xml\" />\n",
 		name, relpath);
@@ -367,22 +1663,22 @@ writeheader(FILE *fp, const char *title)
 	fputs("</td><td><h1>", fp);
 	xmlencode(fp, strippedname, strlen(strippedname));
 	fputs("</h1><span class=\"desc\">", fp);
-	xmlencode(fp, description, strlen(description));
+	xmlencode(fp, meta.description, strlen(meta.description));
 	fputs("</span></td></tr>", fp);
-	if (cloneurl[0]) {
+	if (meta.url[0]) {
 		fputs("<tr class=\"url\"><td></td><td>git clone <a href=\"", fp);
-		xmlencode(fp, cloneurl, strlen(cloneurl));
+		xmlencode(fp, meta.url, strlen(meta.url));
 		fputs("\">", fp);
-		xmlencode(fp, cloneurl, strlen(cloneurl));
+		xmlencode(fp, meta.url, strlen(meta.url));
 		fputs("</a></td></tr>", fp);
 	}
 	fputs("<tr><td></td><td>\n", fp);
 	fprintf(fp, "<a href=\"%slog.html\">Log</a> | ", relpath);
 	fprintf(fp, "<a href=\"%sfiles.html\">Files</a> | ", relpath);
 	fprintf(fp, "<a href=\"%srefs.html\">Refs</a>", relpath);
-	if (submodules)
-		fprintf(fp, " | <a href=\"%sfile/%s.html\">Submodules</a>",
-		        relpath, submodules);
+	if (hasgitmodules)
+		fprintf(fp, " | <a href=\"%ssubmodules.html\">Submodules</a>",
+		        relpath);
 	if (readme)
 		fprintf(fp, " | <a href=\"%sfile/%s.html\">README</a>",
 		        relpath, readme);
@@ -392,17 +1688,60 @@ writeheader(FILE *fp, const char *title)
 	fputs("</td></tr></table>\n<hr/>\n<div id=\"content\">\n", fp);
 }
 
+/* hash of the header of the pages: the metadata of the repository */
+void
+headerhash(git_oid *hash)
+{
+	FILE *fp;
+	char *buf = NULL;
+	size_t len = 0;
+
+	if (!(fp = open_memstream(&buf, &len)))
+		err(1, "open_memstream");
+	writeheader(fp, "");
+	if (fclose(fp))
+		err(1, "fclose");
+	if (git_odb_hash(hash, buf, len, GIT_OBJ_BLOB))
+		errx(1, "hash: header");
+	free(buf);
+}
+
+/* hash of the options and the metadata which the pages of files and
+   directories are made with */
+void
+getpagestate(git_oid *hash)
+{
+	git_oid header;
+	char buf[64 + GIT_OID_HEXSZ];
+
+	headerhash(&header);
+	snprintf(buf, sizeof(buf), "raw %d terse %d header ", rawfiles, terse);
+	git_oid_tostr(buf + strlen(buf), GIT_OID_HEXSZ + 1, &header);
+	if (git_odb_hash(hash, buf, strlen(buf), GIT_OBJ_BLOB))
+		errx(1, "hash: page state");
+}
+
 void
 writefooter(FILE *fp)
 {
 	fputs("</div>\n</body>\n</html>\n", fp);
 }
 
+/* compact: the line numbers are a CSS counter */
+void
+printlinenumber(FILE *fp, size_t n)
+{
+	if (terse)
+		fputs("<i></i>", fp);
+	else
+		fprintf(fp, "<a href=\"#l%zu\" class=\"line\" id=\"l%zu\">%7zu</a> ",
+		        n, n, n);
+}
+
 int
 writeblobhtml(FILE *fp, const git_blob *blob)
 {
 	size_t n = 0, i, prev;
-	const char *nfmt = "<a href=\"#l%d\" class=\"line\" id=\"l%d\">%7d</a> ";
 	const char *s = git_blob_rawcontent(blob);
 	git_off_t len = git_blob_rawsize(blob);
 
@@ -413,14 +1752,14 @@ writeblobhtml(FILE *fp, const git_blob *blob)
 			if (s[i] != '\n')
 				continue;
 			n++;
-			fprintf(fp, nfmt, n, n, n);
+			printlinenumber(fp, n);
 			xmlencode(fp, &s[prev], i - prev + 1);
 			prev = i + 1;
 		}
 		/* trailing data */
 		if ((len - prev) > 0) {
 			n++;
-			fprintf(fp, nfmt, n, n, n);
+			printlinenumber(fp, n);
 			xmlencode(fp, &s[prev], len - prev);
 		}
 	}
@@ -433,12 +1772,22 @@ writeblobhtml(FILE *fp, const git_blob *blob)
 void
 printcommit(FILE *fp, struct commitinfo *ci)
 {
-	fprintf(fp, "<b>commit</b> <a href=\"%scommit/%s.html\">%s</a>\n",
-		relpath, ci->oid, ci->oid);
+	char path[PATH_MAX];
+
+	commitpath(path, sizeof(path), ci->oid, ".html");
+	fprintf(fp, "<b>commit</b> <a href=\"%s%s\">%s</a>",
+		relpath, path, ci->oid);
+	if (patches) {
+		commitpath(path, sizeof(path), ci->oid, ".patch");
+		fprintf(fp, " (<a href=\"%s%s\">patch</a>)", relpath, path);
+	}
+	fputc('\n', fp);
 
-	if (ci->parentoid[0])
-		fprintf(fp, "<b>parent</b> <a href=\"%scommit/%s.html\">%s</a>\n",
-			relpath, ci->parentoid, ci->parentoid);
+	if (ci->parentoid[0]) {
+		commitpath(path, sizeof(path), ci->parentoid, ".html");
+		fprintf(fp, "<b>parent</b> <a href=\"%s%s\">%s</a>\n",
+			relpath, path, ci->parentoid);
+	}
 
 	if (ci->author) {
 		fputs("<b>Author:</b> ", fp);
@@ -458,34 +1807,148 @@ printcommit(FILE *fp, struct commitinfo *ci)
 	}
 }
 
+/* diff line in compact markup: only added and removed lines are elements,
+   lines.js finds them by their position in the hunk */
 void
-printshowfile(FILE *fp, struct commitinfo *ci)
+printlineterse(FILE *fp, const git_diff_line *line)
 {
-	const git_diff_delta *delta;
-	const git_diff_hunk *hunk;
-	const git_diff_line *line;
-	git_patch *patch;
-	size_t nhunks, nhunklines, changed, add, del, total, i, j, k;
-	char linestr[80];
-	int c;
+	if (line->old_lineno == -1)
+		fputs("<ins>+", fp);
+	else if (line->new_lineno == -1)
+		fputs("<del>-", fp);
+	else
+		fputc(' ', fp);
+	xmlencode(fp, line->content, line->content_len);
+	if (line->old_lineno == -1)
+		fputs("</ins>", fp);
+	else if (line->new_lineno == -1)
+		fputs("</del>", fp);
+}
 
-	printcommit(fp, ci);
+/* assign the files of a large commit to its pages, a new page is started
+   after FRAGFILES files or FRAGLINES changed lines. Returns the number of
+   pages */
+size_t
+commitfragments(struct commitinfo *ci)
+{
+	size_t i, n = 0, files = 0, lines = 0;
 
-	if (!ci->deltas)
-		return;
+	for (i = 0; i < ci->ndeltas; i++) {
+		if (!n || files >= FRAGFILES || lines >= FRAGLINES) {
+			n++;
+			files = lines = 0;
+		}
+		ci->deltas[i]->fragment = n;
+		files++;
+		lines += ci->deltas[i]->addcount + ci->deltas[i]->delcount;
+	}
+	return n;
+}
+
+/* patch of the file i of a commit, made again if it was not kept. Free it
+   with deltapatch_free() */
+git_patch *
+deltapatch(struct commitinfo *ci, size_t i)
+{
+	git_patch *patch;
 
-	if (ci->filecount > 1000   ||
-	    ci->ndeltas   > 1000   ||
-	    ci->addcount  > 100000 ||
-	    ci->delcount  > 100000) {
-		fputs("Diff is too large, output suppressed.\n", fp);
+	if (ci->deltas[i]->patch)
+		return ci->deltas[i]->patch;
+	if (git_patch_from_diff(&patch, ci->diff, i))
+		errx(1, "%s: cannot diff '%s'", ci->oid,
+		     ci->deltas[i]->delta->new_file.path);
+	return patch;
+}
+
+void
+deltapatch_free(struct commitinfo *ci, size_t i, git_patch *patch)
+{
+	if (patch != ci->deltas[i]->patch)
+		git_patch_free(patch);
+}
+
+/* diff of the file i of a commit from its patch, NULL if not diffed */
+void
+printdelta(FILE *fp, struct commitinfo *ci, size_t i, git_patch *patch)
+{
+	const git_diff_delta *delta;
+	const git_diff_hunk *hunk;
+	const git_diff_line *line;
+	size_t nhunks, nhunklines, j, k;
+
+	delta = ci->deltas[i]->delta;
+	fprintf(fp, "<b>diff --git a/<a id=\"h%zu\" href=\"%sfile/", i, relpath);
+	xmlencode(fp, delta->old_file.path, strlen(delta->old_file.path));
+	fputs(".html\">", fp);
+	xmlencode(fp, delta->old_file.path, strlen(delta->old_file.path));
+	fprintf(fp, "</a> b/<a href=\"%sfile/", relpath);
+	xmlencode(fp, delta->new_file.path, strlen(delta->new_file.path));
+	fprintf(fp, ".html\">");
+	xmlencode(fp, delta->new_file.path, strlen(delta->new_file.path));
+	fprintf(fp, "</a></b>\n");
+
+	if (ci->deltas[i]->suppressed) {
+		fprintf(fp, "%s\n", ci->deltas[i]->suppressed);
 		return;
 	}
+	/* check binary data */
+	if (delta->flags & GIT_DIFF_FLAG_BINARY) {
+		fputs("Binary files differ.\n", fp);
+		return;
+	}
+
+	nhunks = git_patch_num_hunks(patch);
+	for (j = 0; j < nhunks; j++) {
+		if (git_patch_get_hunk(&hunk, &nhunklines, patch, j))
+			break;
+
+		fprintf(fp, "<a href=\"#h%zu-%zu\" id=\"h%zu-%zu\" class=\"h\">", i, j, i, j);
+		xmlencode(fp, hunk->header, hunk->header_len);
+		fputs("</a>", fp);
+
+		for (k = 0; ; k++) {
+			if (git_patch_get_line_in_hunk(&line, patch, j, k))
+				break;
+			if (terse) {
+				printlineterse(fp, line);
+				continue;
+			}
+			if (line->old_lineno == -1)
+				fprintf(fp, "<a href=\"#h%zu-%zu-%zu\" id=\"h%zu-%zu-%zu\" class=\"i\">+",
+					i, j, k, i, j, k);
+			else if (line->new_lineno == -1)
+				fprintf(fp, "<a href=\"#h%zu-%zu-%zu\" id=\"h%zu-%zu-%zu\" class=\"d\">-",
+					i, j, k, i, j, k);
+			else
+				fputc(' ', fp);
+			xmlencode(fp, line->content, line->content_len);
+			if (line->old_lineno == -1 || line->new_lineno == -1)
+				fputs("</a>", fp);
+		}
+	}
+}
+
+void
+printshowfile(FILE *fp, struct commitinfo *ci)
+{
+	const git_diff_delta *delta;
+	size_t changed, add, del, total, i;
+	char linestr[80];
+	int c, large;
+
+	printcommit(fp, ci);
+
+	if (!ci->deltas)
+		return;
+
+	/* the diff of each file is on a page of commit/<oid>/ */
+	if ((large = commitlarge(ci)))
+		commitfragments(ci);
 
 	/* diff stat */
 	fputs("<b>Diffstat:</b>\n<table>", fp);
 	for (i = 0; i < ci->ndeltas; i++) {
-		delta = git_patch_get_delta(ci->deltas[i]->patch);
+		delta = ci->deltas[i]->delta;
 
 		switch (delta->status) {
 		case GIT_DELTA_ADDED:      c = 'A'; break;
@@ -501,13 +1964,26 @@ printshowfile(FILE *fp, struct commitinfo *ci)
 		else
 			fprintf(fp, "<tr><td class=\"%c\">%c", c, c);
 
-		fprintf(fp, "</td><td><a href=\"#h%zu\">", i);
+		if (large)
+			fprintf(fp, "</td><td><a href=\"%s/%zu.html#h%zu\">",
+			        fanout ? ci->oid + 2 : ci->oid,
+			        ci->deltas[i]->fragment, i);
+		else
+			fprintf(fp, "</td><td><a href=\"#h%zu\">", i);
 		xmlencode(fp, delta->old_file.path, strlen(delta->old_file.path));
 		if (strcmp(delta->old_file.path, delta->new_file.path)) {
 			fputs(" -&gt; ", fp);
 			xmlencode(fp, delta->new_file.path, strlen(delta->new_file.path));
 		}
 
+		if (ci->deltas[i]->suppressed) {
+			fprintf(fp, "</a></td><td> | </td><td class=\"num\"></td>"
+			        "<td>%ju -&gt; %ju bytes</td></tr>\n",
+			        (uintmax_t)blobsize(&(delta->old_file.id)),
+			        (uintmax_t)blobsize(&(delta->new_file.id)));
+			continue;
+		}
+
 		add = ci->deltas[i]->addcount;
 		del = ci->deltas[i]->delcount;
 		changed = add + del;
@@ -535,152 +2011,904 @@ printshowfile(FILE *fp, struct commitinfo *ci)
 
 	fputs("<hr/>", fp);
 
-	for (i = 0; i < ci->ndeltas; i++) {
-		patch = ci->deltas[i]->patch;
-		delta = git_patch_get_delta(patch);
-		fprintf(fp, "<b>diff --git a/<a id=\"h%zu\" href=\"%sfile/", i, relpath);
-		xmlencode(fp, delta->old_file.path, strlen(delta->old_file.path));
-		fputs(".html\">", fp);
-		xmlencode(fp, delta->old_file.path, strlen(delta->old_file.path));
-		fprintf(fp, "</a> b/<a href=\"%sfile/", relpath);
-		xmlencode(fp, delta->new_file.path, strlen(delta->new_file.path));
-		fprintf(fp, ".html\">");
-		xmlencode(fp, delta->new_file.path, strlen(delta->new_file.path));
-		fprintf(fp, "</a></b>\n");
+	if (large) {
+		fputs("Diff is too large for one page, "
+		      "the diff of each file is linked from the diffstat.\n", fp);
+		return;
+	}
+	for (i = 0; i < ci->ndeltas; i++)
+		printdelta(fp, ci, i, ci->deltas[i]->patch);
+}
+
+/* the commit in the format of git-format-patch(1), for git-am(1). The
+   diff is formatted from the patches of the diffstat */
+size_t
+countlines(const char *s, size_t len)
+{
+	const char *e;
+	size_t n = 0;
+
+	for (; (e = memchr(s, '\n', len)); len -= e - s, s = e)
+		n++, e++;
+	return n + (len > 0);
+}
+
+/* lines of a patch with the prefix c */
+void
+printpatchlines(FILE *fp, int c, const char *s, size_t len)
+{
+	const char *e;
+
+	for (; len; len -= e - s, s = e) {
+		if ((e = memchr(s, '\n', len)))
+			e++;
+		else
+			e = s + len;
+		fputc(c, fp);
+		fwrite(s, 1, e - s, fp);
+		if (e[-1] != '\n')
+			fputs("\n\\ No newline at end of file\n", fp);
+	}
+}
+
+/* patch of a file as the removal of all lines of the old file and the
+   addition of all lines of the new file. A file which was not diffed is
+   a binary file, as a -diff file in git, its blobs are not read */
+void
+writerewrite(FILE *fp, const git_diff_delta *delta, int diffed)
+{
+	git_diff_delta d;
+	git_blob *old = NULL, *new = NULL;
+	const char *os = "", *ns = "", *op, *np;
+	char oid[8], nid[8];
+	size_t olen = 0, nlen = 0, on, nn;
+	int added, deleted;
+
+	/* as git: the old file is deleted and the new one added */
+	if (delta->status == GIT_DELTA_TYPECHANGE) {
+		d = *delta;
+		d.status = GIT_DELTA_DELETED;
+		memset(&(d.new_file.id), 0, sizeof(d.new_file.id));
+		writerewrite(fp, &d, diffed);
+		d = *delta;
+		d.status = GIT_DELTA_ADDED;
+		memset(&(d.old_file.id), 0, sizeof(d.old_file.id));
+		writerewrite(fp, &d, diffed);
+		return;
+	}
+	added = delta->status == GIT_DELTA_ADDED;
+	deleted = delta->status == GIT_DELTA_DELETED;
+	op = delta->old_file.path;
+	np = delta->new_file.path;
+
+	fprintf(fp, "diff --git a/%s b/%s\n", op, np);
+	if (added)
+		fprintf(fp, "new file mode %06o\n", delta->new_file.mode);
+	else if (deleted)
+		fprintf(fp, "deleted file mode %06o\n", delta->old_file.mode);
+	else if (delta->old_file.mode != delta->new_file.mode)
+		fprintf(fp, "old mode %06o\nnew mode %06o\n",
+		        delta->old_file.mode, delta->new_file.mode);
+	if (delta->status == GIT_DELTA_RENAMED ||
+	    delta->status == GIT_DELTA_COPIED)
+		fprintf(fp, "similarity index %u%%\n%s from %s\n%s to %s\n",
+		        delta->similarity,
+		        delta->status == GIT_DELTA_RENAMED ? "rename" : "copy", op,
+		        delta->status == GIT_DELTA_RENAMED ? "rename" : "copy", np);
+	if (!git_oid_cmp(&(delta->old_file.id), &(delta->new_file.id)))
+		return;
+
+	if (diffed &&
+	    ((!added && git_blob_lookup(&old, repo, &(delta->old_file.id))) ||
+	    (!deleted && git_blob_lookup(&new, repo, &(delta->new_file.id)))))
+		errx(1, "cannot read blob of '%s'", np);
+	if (old) {
+		os = git_blob_rawcontent(old);
+		olen = git_blob_rawsize(old);
+	}
+	if (new) {
+		ns = git_blob_rawcontent(new);
+		nlen = git_blob_rawsize(new);
+	}
+
+	git_oid_tostr(oid, sizeof(oid), &(delta->old_file.id));
+	git_oid_tostr(nid, sizeof(nid), &(delta->new_file.id));
+	if (added || deleted || delta->old_file.mode != delta->new_file.mode)
+		fprintf(fp, "index %s..%s\n", oid, nid);
+	else
+		fprintf(fp, "index %s..%s %06o\n", oid, nid, delta->new_file.mode);
+	if (!diffed || (old && git_blob_is_binary(old)) ||
+	    (new && git_blob_is_binary(new))) {
+		fprintf(fp, "Binary files %s%s and %s%s differ\n",
+		        added ? "" : "a/", added ? "/dev/null" : op,
+		        deleted ? "" : "b/", deleted ? "/dev/null" : np);
+	} else if (olen || nlen) {
+		fprintf(fp, "--- %s%s\n+++ %s%s\n",
+		        added ? "" : "a/", added ? "/dev/null" : op,
+		        deleted ? "" : "b/", deleted ? "/dev/null" : np);
+		on = countlines(os, olen);
+		nn = countlines(ns, nlen);
+		fprintf(fp, "@@ -%d,%zu +%d,%zu @@\n", on > 0, on, nn > 0, nn);
+		printpatchlines(fp, '-', os, olen);
+		printpatchlines(fp, '+', ns, nlen);
+	}
+	git_blob_free(old);
+	git_blob_free(new);
+}
+
+/* the commit message, diffstat and summary of the patch of a commit */
+void
+writepatchheader(FILE *fp, struct commitinfo *ci)
+{
+	const git_diff_delta *delta;
+	const char *body;
+	size_t i, n, width = 0, nwidth = 1, max = 0, add, del;
+	int len;
+
+	fprintf(fp, "From %s Mon Sep 17 00:00:00 2001\n", ci->oid);
+	if (ci->author) {
+		fprintf(fp, "From: %s <%s>\nDate: ", ci->author->name,
+		        ci->author->email);
+		printtime(fp, &(ci->author->when));
+		fputc('\n', fp);
+	}
+	fprintf(fp, "Subject: [PATCH] %s\n\n", ci->summary ? ci->summary : "");
+	if ((body = git_commit_body(ci->commit)))
+		fprintf(fp, "%s\n", body);
+	fputs("---\n", fp);
+
+	/* diffstat, the graph is at most 50 columns wide */
+	for (i = 0; i < ci->ndeltas; i++) {
+		delta = ci->deltas[i]->delta;
+		n = strlen(delta->old_file.path);
+		if (strcmp(delta->old_file.path, delta->new_file.path))
+			n += 4 + strlen(delta->new_file.path);
+		if (n > width)
+			width = n;
+		n = ci->deltas[i]->addcount + ci->deltas[i]->delcount;
+		if (n > max)
+			max = n;
+	}
+	for (n = max; n >= 10; n /= 10)
+		nwidth++;
+	for (i = 0; i < ci->ndeltas; i++) {
+		delta = ci->deltas[i]->delta;
+		if (strcmp(delta->old_file.path, delta->new_file.path))
+			len = fprintf(fp, " %s => %s", delta->old_file.path,
+			              delta->new_file.path);
+		else
+			len = fprintf(fp, " %s", delta->old_file.path);
+		fprintf(fp, "%*s | ", (int)(width + 1 - len), "");
+		/* a file which was not diffed is in the patch as binary */
+		if (ci->deltas[i]->suppressed) {
+			fprintf(fp, "Bin %ju -> %ju bytes\n",
+			        (uintmax_t)blobsize(&(delta->old_file.id)),
+			        (uintmax_t)blobsize(&(delta->new_file.id)));
+			continue;
+		}
+		if (delta->flags & GIT_DIFF_FLAG_BINARY) {
+			fprintf(fp, "Bin %ju -> %ju bytes\n",
+			        (uintmax_t)delta->old_file.size,
+			        (uintmax_t)delta->new_file.size);
+			continue;
+		}
+		add = ci->deltas[i]->addcount;
+		del = ci->deltas[i]->delcount;
+		fprintf(fp, "%*zu ", (int)nwidth, add + del);
+		if (max > 50) {
+			add = add ? add * 50 / max + (add * 50 < max) : 0;
+			del = del ? del * 50 / max + (del * 50 < max) : 0;
+		}
+		for (n = 0; n < add; n++)
+			fputc('+', fp);
+		for (n = 0; n < del; n++)
+			fputc('-', fp);
+		fputc('\n', fp);
+	}
+	fprintf(fp, " %zu file%s changed", ci->filecount,
+	        ci->filecount == 1 ? "" : "s");
+	if (ci->addcount)
+		fprintf(fp, ", %zu insertion%s(+)", ci->addcount,
+		        ci->addcount == 1 ? "" : "s");
+	if (ci->delcount)
+		fprintf(fp, ", %zu deletion%s(-)", ci->delcount,
+		        ci->delcount == 1 ? "" : "s");
+	fputc('\n', fp);
+	for (i = 0; i < ci->ndeltas; i++) {
+		delta = ci->deltas[i]->delta;
+		if (delta->status == GIT_DELTA_ADDED)
+			fprintf(fp, " create mode %06o %s\n", delta->new_file.mode,
+			        delta->new_file.path);
+		else if (delta->status == GIT_DELTA_DELETED)
+			fprintf(fp, " delete mode %06o %s\n", delta->old_file.mode,
+			        delta->old_file.path);
+		else if (delta->status == GIT_DELTA_RENAMED ||
+		         delta->status == GIT_DELTA_COPIED)
+			fprintf(fp, " %s %s => %s (%u%%)\n",
+			        delta->status == GIT_DELTA_RENAMED ? "rename" : "copy",
+			        delta->old_file.path, delta->new_file.path,
+			        delta->similarity);
+		else if (delta->old_file.mode != delta->new_file.mode)
+			fprintf(fp, " mode change %06o => %06o %s\n",
+			        delta->old_file.mode, delta->new_file.mode,
+			        delta->new_file.path);
+	}
+	fputc('\n', fp);
+}
+
+/* diff of the file i in the patch of a commit, from its patch */
+void
+writepatchdelta(FILE *fp, struct commitinfo *ci, size_t i, git_patch *patch)
+{
+	git_buf buf = { 0 };
+
+	/* git apply does not take a type change as one file */
+	if (!patch || ci->deltas[i]->delta->status == GIT_DELTA_TYPECHANGE) {
+		writerewrite(fp, ci->deltas[i]->delta, patch != NULL);
+		return;
+	}
+	if (git_patch_to_buf(&buf, patch))
+		errx(1, "%s: cannot format patch", ci->oid);
+	fwrite(buf.ptr, 1, buf.size, fp);
+	git_buf_dispose(&buf);
+}
+
+/* the patch of a commit which is not large, from the patches kept of its
+   diffstat */
+void
+writepatch(FILE *fp, struct commitinfo *ci)
+{
+	size_t i;
+
+	writepatchheader(fp, ci);
+	for (i = 0; i < ci->ndeltas; i++)
+		writepatchdelta(fp, ci, i, ci->deltas[i]->patch);
+}
+
+/* pages of the diff of a large commit, written one at a time. The patch
+   of each file is made once for its page and the patch file patchfp, if
+   not NULL */
+void
+writefragments(struct commitinfo *ci, FILE *patchfp)
+{
+	git_patch *patch;
+	FILE *fp;
+	char path[PATH_MAX], ext[32], index[PATH_MAX];
+	const char *oldrelpath = relpath;
+	size_t i, n, npages;
+
+	npages = commitfragments(ci);
+	relpath = fanout ? "../../../" : "../../";
+	commitpath(index, sizeof(index), ci->oid, ".html");
+	for (i = 0, n = 1; n <= npages; n++) {
+		snprintf(ext, sizeof(ext), "/%zu.html", n);
+		commitpath(path, sizeof(path), ci->oid, ext);
+		if (pagedir(path))
+			err(1, "mkdir: '%s'", path);
+		fp = pageopen(path, ci->id);
+		writeheader(fp, ci->summary);
+		fprintf(fp, "<pre><b>commit</b> <a href=\"%s%s\">%s</a>\n",
+		        relpath, index, ci->oid);
+		fprintf(fp, "<b>page</b> %zu of %zu", n, npages);
+		if (n > 1)
+			fprintf(fp, " <a href=\"%zu.html\">previous</a>", n - 1);
+		if (n < npages)
+			fprintf(fp, " <a href=\"%zu.html\">next</a>", n + 1);
+		fputs("\n<hr/>", fp);
+		for (; i < ci->ndeltas && ci->deltas[i]->fragment == n; i++) {
+			patch = ci->deltas[i]->suppressed ? NULL : deltapatch(ci, i);
+			printdelta(fp, ci, i, patch);
+			if (patchfp)
+				writepatchdelta(patchfp, ci, i, patch);
+			deltapatch_free(ci, i, patch);
+		}
+		fputs("</pre>\n", fp);
+		if (terse)
+			fprintf(fp, "<script src=\"%slines.js\"></script>\n", relpath);
+		writefooter(fp);
+		pageclose(fp);
+	}
+	relpath = oldrelpath;
+}
+
+
+void
+writelogline(FILE *fp, struct commitinfo *ci)
+{
+	char path[PATH_MAX];
+
+	fputs("<tr><td>", fp);
+	if (ci->author)
+		printtimeshort(fp, &(ci->author->when));
+	fputs("</td><td>", fp);
+	if (ci->summary) {
+		commitpath(path, sizeof(path), ci->oid, ".html");
+		fprintf(fp, "<a href=\"%s%s\">", relpath, path);
+		xmlencode(fp, ci->summary, strlen(ci->summary));
+		fputs("</a>", fp);
+	}
+	fputs("</td><td>", fp);
+	if (ci->author)
+		xmlencode(fp, ci->author->name, strlen(ci->author->name));
+	fputs("</td><td class=\"num\" align=\"right\">", fp);
+	fprintf(fp, "%zu", ci->filecount);
+	fputs("</td><td class=\"num\" align=\"right\">", fp);
+	fprintf(fp, "+%zu", ci->addcount);
+	fputs("</td><td class=\"num\" align=\"right\">", fp);
+	fprintf(fp, "-%zu", ci->delcount);
+	fputs("</td></tr>\n", fp);
+}
+
+void *
+worker_main(void *arg)
+{
+	struct worker *w = arg;
+	struct job *job;
+	size_t i, k;
+
+	if (git_repository_open_ext(&repo, repodir,
+	    GIT_REPOSITORY_OPEN_NO_SEARCH, NULL) < 0)
+		errx(1, "%s: cannot open repository", repodir);
+	/* the packs, their indexes and alternates are opened once */
+	if (git_repository_set_odb(repo, odb))
+		errx(1, "%s: cannot set object database", repodir);
+
+	for (;;) {
+		/* take the oldest job of its own deque or steal the newest job
+		   of another worker */
+		job = NULL;
+		for (i = 0; i < nworkers && !job; i++) {
+			k = ((w - workers) + i) % nworkers;
+			pthread_mutex_lock(&(workers[k].lock));
+			if (workers[k].len) {
+				if (!i) {
+					job = workers[k].jobs[workers[k].head];
+					workers[k].head = (workers[k].head + 1) % jobwindow;
+				} else {
+					job = workers[k].jobs[(workers[k].head +
+					      workers[k].len - 1) % jobwindow];
+				}
+				workers[k].len--;
+			}
+			pthread_mutex_unlock(&(workers[k].lock));
+		}
+
+		pthread_mutex_lock(&joblock);
+		if (!job) {
+			if (!jobqueued && jobquit) {
+				pthread_mutex_unlock(&joblock);
+				break;
+			}
+			if (!jobqueued)
+				pthread_cond_wait(&jobwork, &joblock);
+			pthread_mutex_unlock(&joblock);
+			continue;
+		}
+		jobqueued--;
+		pthread_mutex_unlock(&joblock);
+
+		job->run(job);
+
+		pthread_mutex_lock(&joblock);
+		job->done = 1;
+		pthread_cond_broadcast(&jobdone);
+		pthread_mutex_unlock(&joblock);
+	}
+
+	git_commit_free(lastparent);
+	git_tree_free(lastparenttree);
+	git_repository_free(repo);
+
+	return NULL;
+}
+
+/* start a worker per CPU if libgit2 supports threads, else jobs run in
+   the main thread when they are submitted */
+void
+jobs_start(void)
+{
+	long ncpu;
+	size_t i;
+
+	if (!(git_libgit2_features() & GIT_FEATURE_THREADS) ||
+	    (ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		ncpu = 0;
+	nworkers = ncpu;
+	jobwindow = nworkers ? nworkers * JOBSPERWORKER : 1;
+
+	if (nworkers && !(workers = calloc(nworkers, sizeof(*workers))))
+		err(1, "calloc");
+	for (i = 0; i < nworkers; i++) {
+		if (!(workers[i].jobs = calloc(jobwindow, sizeof(struct job *))))
+			err(1, "calloc");
+		if (pthread_mutex_init(&(workers[i].lock), NULL))
+			errx(1, "pthread_mutex_init");
+	}
+	for (i = 0; i < nworkers; i++)
+		if (pthread_create(&(workers[i].thread), NULL, worker_main, &workers[i]))
+			errx(1, "pthread_create");
+}
+
+/* write out the oldest job, wait for it if needed */
+void
+jobs_emitone(void)
+{
+	struct job *job = jobhead;
+
+	pthread_mutex_lock(&joblock);
+	while (!job->done)
+		pthread_cond_wait(&jobdone, &joblock);
+	pthread_mutex_unlock(&joblock);
+
+	if (!(jobhead = job->next))
+		jobtail = NULL;
+	njobs--;
+
+	if (job->emit)
+		job->emit(job);
+	free(job->row);
+	free(job->author);
+	free(job);
+}
+
+void
+tableend_emit(struct job *job)
+{
+	fputs("</tbody></table>", job->fp);
+}
+
+void
+pageend_emit(struct job *job)
+{
+	writefooter(job->fp);
+	pageclose(job->fp);
+}
+
+void
+jobs_flush(void)
+{
+	while (jobhead)
+		jobs_emitone();
+}
+
+void
+jobs_stop(void)
+{
+	size_t i;
+
+	jobs_flush();
+
+	pthread_mutex_lock(&joblock);
+	jobquit = 1;
+	pthread_cond_broadcast(&jobwork);
+	pthread_mutex_unlock(&joblock);
+
+	for (i = 0; i < nworkers; i++) {
+		pthread_join(workers[i].thread, NULL);
+		pthread_mutex_destroy(&(workers[i].lock));
+		free(workers[i].jobs);
+	}
+	free(workers);
+	workers = NULL;
+	nworkers = 0;
+}
+
+struct job *
+job_new(void (*run)(struct job *), void (*emit)(struct job *), FILE *fp)
+{
+	struct job *job;
+
+	if (!(job = calloc(1, sizeof(*job))))
+		err(1, "calloc");
+	job->run = run;
+	job->emit = emit;
+	job->fp = fp;
+
+	return job;
+}
+
+void
+job_submit(struct job *job)
+{
+	struct worker *w;
+
+	/* bound the jobs in flight: write out the oldest jobs first */
+	while (njobs >= jobwindow)
+		jobs_emitone();
+
+	if (jobtail)
+		jobtail->next = job;
+	else
+		jobhead = job;
+	jobtail = job;
+	njobs++;
+
+	if (!job->run || !nworkers) {
+		if (job->run)
+			job->run(job);
+		job->done = 1;
+	} else {
+		if (job->follows && nextworker)
+			w = &workers[(nextworker - 1) % nworkers];
+		else
+			w = &workers[nextworker++ % nworkers];
+		/* count the job before a worker can take it */
+		pthread_mutex_lock(&joblock);
+		jobqueued++;
+		pthread_mutex_lock(&(w->lock));
+		w->jobs[(w->head + w->len++) % jobwindow] = job;
+		pthread_mutex_unlock(&(w->lock));
+		pthread_cond_signal(&jobwork);
+		pthread_mutex_unlock(&joblock);
+	}
+
+	/* write out what is finished already */
+	while (jobhead && jobhead->done)
+		jobs_emitone();
+}
+
+/* call emit in the main thread after all previously submitted jobs */
+void
+job_call(void (*emit)(struct job *), FILE *fp)
+{
+	job_submit(job_new(NULL, emit, fp));
+}
+
+/* path of a commit in the shared store: storedir/ab/cdef... */
+void
+storepath(char *buf, size_t bufsiz, const char *oid)
+{
+	char attrs[GIT_OID_HEXSZ + 3] = "";
+	int r;
+
+	/* the attributes outside the trees decide which files are diffed,
+	   they differ between repositories */
+	if (attrglobal) {
+		strlcpy(attrs, ".a", sizeof(attrs));
+		git_oid_tostr(attrs + 2, sizeof(attrs) - 2, &attrstate);
+	}
+	/* the links in the diff depend on the layout of the commit pages */
+	r = snprintf(buf, bufsiz, "%s/%.2s/%s%s%s%s%s%s", storedir, oid, oid + 2,
+	             fanout ? ".f" : "", patches ? ".g" : "", terse ? ".t" : "",
+	             diffalgo == GIT_DIFF_PATIENCE ? ".p" :
+	             diffalgo == GIT_DIFF_MINIMAL ? ".m" : "", attrs);
+	if (r < 0 || (size_t)r >= bufsiz)
+		errx(1, "path truncated: '%s/%.2s/%s'", storedir, oid, oid + 2);
+}
+
+/* open a commit of the shared store and read its diffstat, the rest of
+   the file is the diff */
+FILE *
+store_open(struct commitinfo *ci)
+{
+	FILE *fp;
+	char path[PATH_MAX];
+
+	storepath(path, sizeof(path), ci->oid);
+	if (!(fp = fopen(path, "r")))
+		return NULL;
+	if (fscanf(fp, "%zu %zu %zu\n", &(ci->filecount), &(ci->addcount),
+	    &(ci->delcount)) != 3) {
+		fclose(fp);
+		ci->filecount = ci->addcount = ci->delcount = 0;
+		return NULL;
+	}
+
+	return fp;
+}
+
+/* add a commit to the shared store, other repositories may write it at
+   the same time: write a temporary file and rename it */
+void
+store_write(struct commitinfo *ci, const char *diff, size_t difflen)
+{
+	FILE *fp;
+	char path[PATH_MAX], tmppath[PATH_MAX], *d;
+	int fd;
+
+	storepath(path, sizeof(path), ci->oid);
+	strlcpy(tmppath, path, sizeof(tmppath));
+	if (!(d = dirname(tmppath)))
+		err(1, "dirname");
+	if (mkdirp(d))
+		err(1, "mkdir: '%s'", d);
+	if (strlcat(tmppath, "/tmp.XXXXXXXXXXXX", sizeof(tmppath)) >= sizeof(tmppath))
+		errx(1, "path truncated: '%s/tmp.XXXXXXXXXXXX'", d);
+
+	if ((fd = mkstemp(tmppath)) == -1)
+		err(1, "mkstemp: '%s'", tmppath);
+	if (!(fp = fdopen(fd, "w")))
+		err(1, "fdopen: '%s'", tmppath);
+	fprintf(fp, "%zu %zu %zu\n", ci->filecount, ci->addcount, ci->delcount);
+	fwrite(diff, 1, difflen, fp);
+	if (fclose(fp))
+		err(1, "fclose: '%s'", tmppath);
+	if (rename(tmppath, path))
+		err(1, "rename: '%s' to '%s'", tmppath, path);
+}
+
+/* diffstat, for stagit HTML required for the log.html line, and the
+   commit file.  With a shared store the diffstat and the diff are read
+   from it if another repository has written the commit already */
+/* source of a commit page cut short by the time budget: the commit and
+   the budget of the run */
+void
+cutsource(git_oid *source, const git_oid *id)
+{
+	char buf[64 + GIT_OID_HEXSZ], oid[GIT_OID_HEXSZ + 1];
+
+	git_oid_tostr(oid, sizeof(oid), id);
+	snprintf(buf, sizeof(buf), "budget %ld %ld %s", filebudget, commitbudget,
+	         oid);
+	if (git_odb_hash(source, buf, strlen(buf), GIT_OBJ_BLOB))
+		errx(1, "hash: budget of %s", oid);
+}
+
+/* commit page which was cut short by the time budget of an earlier run
+   with another budget, according to the manifest */
+int
+commitcut(const git_oid *id, const char *path)
+{
+	struct manifestentry *e;
+	git_oid source;
+
+	if (!manifestfile || !(e = manifest_find(path)) ||
+	    !git_oid_cmp(&(e->source), id))
+		return 0;
+	cutsource(&source, id);
+	return git_oid_cmp(&(e->source), &source) != 0;
+}
+
+void
+commitjob_run(struct job *job)
+{
+	struct commitinfo *ci;
+	FILE *fp, *storefp = NULL, *patchfp = NULL;
+	git_oid source;
+	char *diff = NULL, buf[BUFSIZ], path[PATH_MAX];
+	size_t difflen = 0, n;
+	int patchfailed = 0;
+
+	if (!(ci = commitinfo_getbyoid(&(job->id))) ||
+	    (!(storedir && (storefp = store_open(ci))) &&
+	    commitinfo_getstats(ci) == -1)) {
+		job->error = 1;
+		commitinfo_free(ci);
+		return;
+	}
+
+	relpath = "";
+	if (!(fp = open_memstream(&(job->row), &(job->rowlen))))
+		err(1, "open_memstream");
+	writelogline(fp, ci);
+	fclose(fp);
+	job->hasparent = ci->parentoid[0] != '\0';
+
+	relpath = fanout ? "../../" : "../";
+	/* the pages of the diff of large commits are not in the store, nor
+	   diffs cut short by the time budget of this run */
+	if (storedir && !storefp && !commitlarge(ci) && !ci->overbudget) {
+		if (!(fp = open_memstream(&diff, &difflen)))
+			err(1, "open_memstream");
+		printshowfile(fp, ci);
+		fclose(fp);
+		store_write(ci, diff, difflen);
+	}
+
+	/* check if file exists if so skip it */
+	if (!job->exists) {
+		if (pagedir(job->path))
+			err(1, "mkdir: '%s'", job->path);
+		/* the manifest tells a later run the page was cut short */
+		if (ci->overbudget)
+			cutsource(&source, &(job->id));
+		else
+			source = job->id;
+		fp = pageopen(job->path, &source);
+		writeheader(fp, ci->summary);
+		fputs("<pre>", fp);
+		if (storefp) {
+			while ((n = fread(buf, 1, sizeof(buf), storefp)))
+				fwrite(buf, 1, n, fp);
+			if (ferror(storefp))
+				err(1, "fread");
+		} else if (diff) {
+			fwrite(diff, 1, difflen, fp);
+		} else {
+			printshowfile(fp, ci);
+		}
+		fputs("</pre>\n", fp);
+		if (terse)
+			fprintf(fp, "<script src=\"%slines.js\"></script>\n", relpath);
+		writefooter(fp);
+		pageclose(fp);
+
+		/* the store has no patches: only then the commit is diffed
+		   for it */
+		if (patches && storefp) {
+			ci->addcount = ci->delcount = 0;
+			if (commitinfo_getstats(ci))
+				patchfailed = 1;
+		}
+		if (patches && !patchfailed) {
+			commitpath(path, sizeof(path), ci->oid, ".patch");
+			patchfp = pageopen(path, &(job->id));
+		}
+		/* the patches of a large commit are not kept: each is made
+		   once for its page and the patch file */
+		if (!storefp && ci->deltas && commitlarge(ci)) {
+			if (patchfp)
+				writepatchheader(patchfp, ci);
+			writefragments(ci, patchfp);
+		} else if (patchfp) {
+			writepatch(patchfp, ci);
+		}
+		if (patchfp)
+			pageclose(patchfp);
+	}
+	relpath = "";
+
+	if (storefp)
+		fclose(storefp);
+	free(diff);
+	commitinfo_keepparent(ci);
+	commitinfo_free(ci);
+}
+
+void
+commitjob_emit(struct job *job)
+{
+	char oid[GIT_OID_HEXSZ + 1];
 
-		/* check binary data */
-		if (delta->flags & GIT_DIFF_FLAG_BINARY) {
-			fputs("Binary files differ.\n", fp);
-			continue;
-		}
+	/* the log would miss a commit: stop like the log walk does */
+	if (job->error)
+		errx(1, "%s: cannot read commit",
+		     git_oid_tostr(oid, sizeof(oid), &(job->id)));
+
+	if (nlogcommits < 0) {
+		fwrite(job->row, 1, job->rowlen, job->fp);
+	} else if (nlogcommits > 0) {
+		fwrite(job->row, 1, job->rowlen, job->fp);
+		nlogcommits--;
+		if (!nlogcommits && job->hasparent)
+			fputs("<tr><td></td><td colspan=\"5\">"
+			      "More commits remaining [...]</td>"
+			      "</tr>\n", job->fp);
+	}
 
-		nhunks = git_patch_num_hunks(patch);
-		for (j = 0; j < nhunks; j++) {
-			if (git_patch_get_hunk(&hunk, &nhunklines, patch, j))
-				break;
+	if (cachefile)
+		fwrite(job->row, 1, job->rowlen, wcachefp);
+}
 
-			fprintf(fp, "<a href=\"#h%zu-%zu\" id=\"h%zu-%zu\" class=\"h\">", i, j, i, j);
-			xmlencode(fp, hunk->header, hunk->header_len);
-			fputs("</a>", fp);
+/* after the new log lines: the previous log from the cache, the footer */
+void
+logend_emit(struct job *job)
+{
+	FILE *fp = job->fp;
+	char buf[BUFSIZ];
+	size_t n;
 
-			for (k = 0; ; k++) {
-				if (git_patch_get_line_in_hunk(&line, patch, j, k))
-					break;
-				if (line->old_lineno == -1)
-					fprintf(fp, "<a href=\"#h%zu-%zu-%zu\" id=\"h%zu-%zu-%zu\" class=\"i\">+",
-						i, j, k, i, j, k);
-				else if (line->new_lineno == -1)
-					fprintf(fp, "<a href=\"#h%zu-%zu-%zu\" id=\"h%zu-%zu-%zu\" class=\"d\">-",
-						i, j, k, i, j, k);
-				else
-					fputc(' ', fp);
-				xmlencode(fp, line->content, line->content_len);
-				if (line->old_lineno == -1 || line->new_lineno == -1)
-					fputs("</a>", fp);
-			}
+	if (rcachefp) {
+		/* append previous log to log.html and the new cache */
+		while (!feof(rcachefp)) {
+			n = fread(buf, 1, sizeof(buf), rcachefp);
+			if (ferror(rcachefp))
+				err(1, "fread");
+			if (fwrite(buf, 1, n, fp) != n ||
+			    fwrite(buf, 1, n, wcachefp) != n)
+				err(1, "fwrite");
 		}
+		fclose(rcachefp);
 	}
+	if (wcachefp)
+		fclose(wcachefp);
+
+	fputs("</tbody></table>", fp);
+	writefooter(fp);
+	pageclose(fp);
 }
 
+/* the commits before the cached commit are not visited: write their pages
+   again which were cut short by another time budget */
 void
-writelogline(FILE *fp, struct commitinfo *ci)
+writecut(void)
 {
-	fputs("<tr><td>", fp);
-	if (ci->author)
-		printtimeshort(fp, &(ci->author->when));
-	fputs("</td><td>", fp);
-	if (ci->summary) {
-		fprintf(fp, "<a href=\"%scommit/%s.html\">", relpath, ci->oid);
-		xmlencode(fp, ci->summary, strlen(ci->summary));
-		fputs("</a>", fp);
+	struct job *job;
+	git_oid id;
+	const char *p;
+	char hex[GIT_OID_HEXSZ + 1];
+	size_t i, n;
+
+	for (i = manifest_lower("commit/");
+	     i < nmanifest && !strncmp(manifest[i].path, "commit/", 7); i++) {
+		/* commit/<oid>.html or commit/<ab>/<cdef...>.html */
+		for (p = manifest[i].path + 7, n = 0;
+		     *p && *p != '.' && n < GIT_OID_HEXSZ; p++) {
+			if (*p != '/')
+				hex[n++] = *p;
+		}
+		hex[n] = '\0';
+		if (n != GIT_OID_HEXSZ || strcmp(p, ".html") ||
+		    git_oid_fromstr(&id, hex) || !commitcut(&id, manifest[i].path))
+			continue;
+
+		job = job_new(commitjob_run, NULL, NULL);
+		job->id = id;
+		strlcpy(job->path, manifest[i].path, sizeof(job->path));
+		job_submit(job);
 	}
-	fputs("</td><td>", fp);
-	if (ci->author)
-		xmlencode(fp, ci->author->name, strlen(ci->author->name));
-	fputs("</td><td class=\"num\" align=\"right\">", fp);
-	fprintf(fp, "%zu", ci->filecount);
-	fputs("</td><td class=\"num\" align=\"right\">", fp);
-	fprintf(fp, "+%zu", ci->addcount);
-	fputs("</td><td class=\"num\" align=\"right\">", fp);
-	fprintf(fp, "-%zu", ci->delcount);
-	fputs("</td></tr>\n", fp);
 }
 
 int
 writelog(FILE *fp, const git_oid *oid)
 {
-	struct commitinfo *ci;
+	struct job *job;
 	git_revwalk *w = NULL;
 	git_oid id;
-	char path[PATH_MAX], oidstr[GIT_OID_HEXSZ + 1];
-	FILE *fpfile;
-	int r;
+	long long nlog = nlogcommits; /* log lines remaining */
+	char oidstr[GIT_OID_HEXSZ + 1], path[PATH_MAX];
+	int exists, n = 0;
 
 	git_revwalk_new(&w, repo);
 	git_revwalk_push(w, oid);
 	git_revwalk_simplify_first_parent(w);
 
 	while (!git_revwalk_next(&id, w)) {
-		relpath = "";
-
-		if (cachefile && !memcmp(&id, &lastoid, sizeof(id)))
+		if (cachefile && !memcmp(&id, &lastoid, sizeof(id))) {
+			/* the older commits are not visited: keep their pages */
+			manifest_keepdir("commit/");
+			writecut();
 			break;
+		}
 
 		git_oid_tostr(oidstr, sizeof(oidstr), &id);
-		r = snprintf(path, sizeof(path), "commit/%s.html", oidstr);
-		if (r < 0 || (size_t)r >= sizeof(path))
-			errx(1, "path truncated: 'commit/%s.html'", oidstr);
-		r = access(path, F_OK);
+		commitpath(path, sizeof(path), oidstr, ".html");
+		/* a page cut short by the time budget is written again when
+		   the budget changed */
+		exists = oidset_has(&pages, &id) && !commitcut(&id, path);
+		if (exists && patches) {
+			commitpath(path, sizeof(path), oidstr, ".patch");
+			manifest_keep(path);
+		}
+		if (exists) {
+			commitpath(path, sizeof(path), oidstr, "/");
+			manifest_keepdir(path);
+		}
+		commitpath(path, sizeof(path), oidstr, ".html");
+		if (exists)
+			manifest_keep(path);
 
 		/* optimization: if there are no log lines to write and
 		   the commit file already exists: skip the diffstat */
-		if (!nlogcommits && !r)
+		if (!nlog && exists)
 			continue;
-
-		if (!(ci = commitinfo_getbyoid(&id)))
-			break;
-		/* diffstat: for stagit HTML required for the log.html line */
-		if (commitinfo_getstats(ci) == -1)
-			goto err;
-
-		if (nlogcommits < 0) {
-			writelogline(fp, ci);
-		} else if (nlogcommits > 0) {
-			writelogline(fp, ci);
-			nlogcommits--;
-			if (!nlogcommits && ci->parentoid[0])
-				fputs("<tr><td></td><td colspan=\"5\">"
-				      "More commits remaining [...]</td>"
-				      "</tr>\n", fp);
-		}
-
-		if (cachefile)
-			writelogline(wcachefp, ci);
-
-		/* check if file exists if so skip it */
-		if (r) {
-			relpath = "../";
-			fpfile = efopen(path, "w");
-			writeheader(fpfile, ci->summary);
-			fputs("<pre>", fpfile);
-			printshowfile(fpfile, ci);
-			fputs("</pre>\n", fpfile);
-			writefooter(fpfile);
-			fclose(fpfile);
-		}
-err:
-		commitinfo_free(ci);
+		if (nlog > 0)
+			nlog--;
+
+		/* the page exists after this run, for links from tag pages */
+		if (!exists)
+			oidset_add(&pages, &id);
+
+		job = job_new(commitjob_run, commitjob_emit, fp);
+		job->id = id;
+		job->exists = exists;
+		strlcpy(job->path, path, sizeof(job->path));
+		/* a run of commits goes to one worker, which diffs them in order
+		   and reuses the parent objects of each commit for the next */
+		job->follows = n++ % COMMITRUN != 0;
+
+		job_submit(job);
 	}
 	git_revwalk_free(w);
 
-	relpath = "";
-
 	return 0;
 }
 
 void
 printcommitatom(FILE *fp, struct commitinfo *ci)
 {
+	char path[PATH_MAX];
+
 	fputs("<entry>\n", fp);
 
 	fprintf(fp, "<id>%s</id>\n", ci->oid);
@@ -699,8 +2927,9 @@ printcommitatom(FILE *fp, struct commitinfo *ci)
 		xmlencode(fp, ci->summary, strlen(ci->summary));
 		fputs("</title>\n", fp);
 	}
-	fprintf(fp, "<link rel=\"alternate\" type=\"text/html\" href=\"commit/%s.html\" />\n",
-	        ci->oid);
+	commitpath(path, sizeof(path), ci->oid, ".html");
+	fprintf(fp, "<link rel=\"alternate\" type=\"text/html\" href=\"%s\" />\n",
+	        path);
 
 	if (ci->author) {
 		fputs("<author>\n<name>", fp);
@@ -742,7 +2971,7 @@ writeatom(FILE *fp)
 	      "<feed xmlns=\"http://www.w3.org/2005/Atom\">\n<title>", fp);
 	xmlencode(fp, strippedname, strlen(strippedname));
 	fputs(", branch HEAD</title>\n<subtitle>", fp);
-	xmlencode(fp, description, strlen(description));
+	xmlencode(fp, meta.description, strlen(meta.description));
 	fputs("</subtitle>\n", fp);
 
 	git_revwalk_new(&w, repo);
@@ -782,19 +3011,94 @@ writemarkdownblob(FILE *fp, git_blob *blob)
 }
 #endif
 
+/* write the blob to rawpath unmodified: a hard link to blob/<oid>, which
+   is written once for all paths and runs with the same content */
+void
+writeraw(git_blob *blob, const char *rawpath)
+{
+	struct stat st, bst;
+	const git_oid *id = git_blob_id(blob);
+	const char *buf = git_blob_rawcontent(blob);
+	size_t len = git_blob_rawsize(blob), n;
+	char oid[GIT_OID_HEXSZ + 1], bpath[PATH_MAX], tmp[PATH_MAX];
+	ssize_t r;
+	FILE *fp;
+	int fd, first, stale;
+
+	/* no links in an archive, the content is written as a page */
+	if (archivefile) {
+		fp = pageopen(rawpath, id);
+		fwrite(buf, 1, len, fp);
+		pageclose(fp);
+		return;
+	}
+
+	git_oid_tostr(oid, sizeof(oid), id);
+	joinpath(bpath, sizeof(bpath), "blob", oid);
+
+	/* the first job with the blob checks and records it, the file is
+	   written outside the lock */
+	pthread_mutex_lock(&blobslock);
+	first = oidset_add(&blobs, id);
+	stale = first && (stat(bpath, &bst) == -1 ||
+	                  (size_t)bst.st_size != len);
+	pthread_mutex_unlock(&blobslock);
+
+	/* a job with the same blob while the first one still writes it
+	   writes the same content: each file is renamed into place whole */
+	if (!first && (stat(bpath, &bst) == -1 || (size_t)bst.st_size != len))
+		stale = 1;
+	if (stale) {
+		if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", bpath) >=
+		    (int)sizeof(tmp))
+			errx(1, "path truncated: '%s.XXXXXX'", bpath);
+		if ((fd = mkstemp(tmp)) == -1)
+			err(1, "mkstemp: '%s'", tmp);
+		for (n = 0; n < len; n += r)
+			if ((r = write(fd, buf + n, len - n)) == -1)
+				err(1, "write: '%s'", tmp);
+		if (fchmod(fd, (S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|
+		    S_IWOTH) & ~mask) == -1 ||
+		    close(fd) == -1)
+			err(1, "close: '%s'", tmp);
+		if (rename(tmp, bpath))
+			err(1, "rename: '%s' to '%s'", tmp, bpath);
+		if (first)
+			changed(bpath);
+	}
+	/* the content hash of a blob is its id */
+	if (first && manifestfile)
+		manifest_update(bpath, id, id, NULL, 0);
+
+	/* same blob as the last run */
+	if (stat(rawpath, &st) == -1 || stat(bpath, &bst) == -1 ||
+	    st.st_dev != bst.st_dev || st.st_ino != bst.st_ino) {
+		if (pagedir(rawpath))
+			err(1, "mkdir: '%s'", rawpath);
+		if (unlink(rawpath) == -1 && errno != ENOENT)
+			err(1, "unlink: '%s'", rawpath);
+		/* copy where hard links are not supported */
+		if (link(bpath, rawpath) == -1) {
+			fp = efopen(rawpath, "w");
+			if (fwrite(buf, 1, len, fp) != len || fclose(fp))
+				err(1, "fwrite: '%s'", rawpath);
+		}
+		changed(rawpath);
+	}
+	if (manifestfile && !strchr(rawpath, '\n'))
+		manifest_update(rawpath, id, id, NULL, 0);
+}
+
 int
-writeblob(git_object *obj, const char *fpath, const char *filename, git_off_t filesize)
+writeblob(git_object *obj, const char *fpath, const char *rawpath,
+          const char *filename, git_off_t filesize, int attr)
 {
-	char tmp[PATH_MAX] = "", *d;
+	char tmp[PATH_MAX] = "";
 	const char *p;
 	int lc = 0;
 	FILE *fp;
 
-	if (strlcpy(tmp, fpath, sizeof(tmp)) >= sizeof(tmp))
-		errx(1, "path truncated: '%s'", fpath);
-	if (!(d = dirname(tmp)))
-		err(1, "dirname");
-	if (mkdirp(d))
+	if (pagedir(fpath))
 		return -1;
 
 	for (p = fpath, tmp[0] = '\0'; *p; p++) {
@@ -803,14 +3107,21 @@ writeblob(git_object *obj, const char *fpath, const char *filename, git_off_t fi
 	}
 	relpath = tmp;
 
-	fp = efopen(fpath, "w");
+	fp = pageopen(fpath, git_object_id(obj));
 	writeheader(fp, filename);
 	fputs("<p> ", fp);
 	xmlencode(fp, filename, strlen(filename));
 	fprintf(fp, " (%juB)", (uintmax_t)filesize);
+	if (rawpath) {
+		fprintf(fp, " <a href=\"%s", relpath);
+		xmlencode(fp, rawpath, strlen(rawpath));
+		fputs("\">raw</a>", fp);
+	}
 	fputs("</p><hr/>", fp);
 
-	if (git_blob_is_binary((git_blob *)obj)) {
+	if (attr == ATTR_GENERATED) {
+		fputs("<p>Generated file.</p>\n", fp);
+	} else if (attr == ATTR_BINARY || git_blob_is_binary((git_blob *)obj)) {
 		fputs("<p>Binary file.</p>\n", fp);
 #ifdef USE_LOWDOWN
 	} else if (strlen(filename) >= 3 && !strcmp(filename + strlen(filename) - 3, ".md")) {
@@ -822,9 +3133,11 @@ writeblob(git_object *obj, const char *fpath, const char *filename, git_off_t fi
 		lc = writeblobhtml(fp, (git_blob *)obj);
 		if (ferror(fp))
 			err(1, "fwrite");
+		if (terse)
+			fprintf(fp, "<script src=\"%slines.js\"></script>\n", relpath);
 	}
 	writefooter(fp);
-	fclose(fp);
+	pageclose(fp);
 
 	relpath = "";
 
@@ -834,7 +3147,7 @@ writeblob(git_object *obj, const char *fpath, const char *filename, git_off_t fi
 const char *
 filemode(git_filemode_t m)
 {
-	static char mode[11];
+	static __thread char mode[11];
 
 	memset(mode, '-', sizeof(mode) - 1);
 	mode[10] = '\0';
@@ -873,17 +3186,469 @@ filemode(git_filemode_t m)
 	return mode;
 }
 
+uint32_t
+getbe32(const unsigned char *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	       (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
 int
-writefilestree(FILE *fp, git_tree *tree, const char *path)
+offset_cmp(const void *v1, const void *v2)
+{
+	uint64_t o1 = *(const uint64_t *)v1, o2 = *(const uint64_t *)v2;
+
+	return (o1 > o2) - (o1 < o2);
+}
+
+int
+packorder_cmp(const void *v1, const void *v2)
+{
+	const struct packorder *p1 = v1, *p2 = v2;
+
+	if (p1->pack != p2->pack)
+		return (p1->pack > p2->pack) - (p1->pack < p2->pack);
+	return (p1->offset > p2->offset) - (p1->offset < p2->offset);
+}
+
+/* map the version 2 pack indexes of the repository */
+void
+packs_open(void)
+{
+	struct pack *p;
+	struct dirent *dp;
+	struct stat st;
+	DIR *dir;
+	char packdir[PATH_MAX], path[PATH_MAX];
+	const unsigned char *offsets, *large;
+	size_t len, i;
+	uint32_t off;
+	int fd;
+
+	joinpath(packdir, sizeof(packdir), git_repository_path(repo), "objects/pack");
+	if (!(dir = opendir(packdir)))
+		return;
+	while ((dp = readdir(dir))) {
+		len = strlen(dp->d_name);
+		if (len < 4 || strcmp(dp->d_name + len - 4, ".idx"))
+			continue;
+		joinpath(path, sizeof(path), packdir, dp->d_name);
+		if ((fd = open(path, O_RDONLY)) == -1)
+			continue;
+		if (fstat(fd, &st) == -1 || st.st_size < 8 + 256 * 4) {
+			close(fd);
+			continue;
+		}
+		if (!(packs = reallocarray(packs, npacks + 1, sizeof(*packs))))
+			err(1, "realloc");
+		p = &packs[npacks];
+		memset(p, 0, sizeof(*p));
+		p->idxsize = st.st_size;
+		p->idx = mmap(NULL, p->idxsize, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (p->idx == MAP_FAILED)
+			continue;
+		/* version 1 indexes are not used by git since 2007 */
+		if (memcmp(p->idx, "\377tOc", 4) || getbe32(p->idx + 4) != 2) {
+			munmap(p->idx, p->idxsize);
+			continue;
+		}
+		p->nobjects = getbe32(p->idx + 8 + 255 * 4);
+		if (p->idxsize < 8 + 256 * 4 + (size_t)p->nobjects * 28) {
+			munmap(p->idx, p->idxsize);
+			continue;
+		}
+
+		/* pack-<id>.idx -> pack-<id>.pack */
+		path[strlen(path) - strlen("idx")] = '\0';
+		if (strlcat(path, "pack", sizeof(path)) >= sizeof(path))
+			errx(1, "path truncated: '%spack'", path);
+		if ((p->fd = open(path, O_RDONLY)) == -1 || fstat(p->fd, &st) == -1) {
+			munmap(p->idx, p->idxsize);
+			if (p->fd != -1)
+				close(p->fd);
+			continue;
+		}
+		p->packsize = st.st_size;
+
+		/* all object offsets sorted: the next one is the end of an object */
+		if (!(p->offsets = calloc(p->nobjects, sizeof(uint64_t))))
+			err(1, "calloc");
+		offsets = p->idx + 8 + 256 * 4 + (size_t)p->nobjects * 24;
+		large = offsets + (size_t)p->nobjects * 4;
+		for (i = 0; i < p->nobjects; i++) {
+			off = getbe32(offsets + i * 4);
+			if (off & 0x80000000) {
+				off &= 0x7fffffff;
+				p->offsets[i] = (uint64_t)getbe32(large + off * 8) << 32 |
+				                getbe32(large + off * 8 + 4);
+			} else {
+				p->offsets[i] = off;
+			}
+		}
+		qsort(p->offsets, p->nobjects, sizeof(uint64_t), offset_cmp);
+		npacks++;
+	}
+	closedir(dir);
+}
+
+void
+packs_close(void)
+{
+	size_t i;
+
+	for (i = 0; i < npacks; i++) {
+		munmap(packs[i].idx, packs[i].idxsize);
+		close(packs[i].fd);
+		free(packs[i].offsets);
+	}
+	free(packs);
+	packs = NULL;
+	npacks = 0;
+}
+
+/* find the pack and offset of an object, the pack is npacks if not found */
+void
+pack_find(const git_oid *id, size_t *pack, uint64_t *offset)
+{
+	struct pack *p;
+	const unsigned char *oids, *offsets, *large;
+	uint32_t lo, hi, mid, off;
+	size_t i;
+	int r;
+
+	for (i = 0; i < npacks; i++) {
+		p = &packs[i];
+		lo = id->id[0] ? getbe32(p->idx + 8 + (id->id[0] - 1) * 4) : 0;
+		hi = getbe32(p->idx + 8 + id->id[0] * 4);
+		oids = p->idx + 8 + 256 * 4;
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (!(r = memcmp(id->id, oids + (size_t)mid * 20, 20))) {
+				offsets = oids + (size_t)p->nobjects * 24;
+				large = offsets + (size_t)p->nobjects * 4;
+				off = getbe32(offsets + (size_t)mid * 4);
+				if (off & 0x80000000) {
+					off &= 0x7fffffff;
+					*offset = (uint64_t)getbe32(large + off * 8) << 32 |
+					          getbe32(large + off * 8 + 4);
+				} else {
+					*offset = off;
+				}
+				*pack = i;
+				return;
+			}
+			if (r < 0)
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+	}
+	*pack = npacks;
+	*offset = 0;
+}
+
+/* end of the object at offset: the start of the next object in the pack */
+uint64_t
+pack_objectend(struct pack *p, uint64_t offset)
+{
+	size_t lo = 0, hi = p->nobjects, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (p->offsets[mid] <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	/* the pack ends with a checksum */
+	return lo < p->nobjects ? p->offsets[lo] : (uint64_t)p->packsize - 20;
+}
+
+/* read ahead the objects sorted by pack offset, adjacent objects are
+   merged into one range */
+void
+packs_readahead(struct packorder *po, size_t n)
+{
+	uint64_t start = 0, end = 0, objend;
+	size_t i, pack = npacks;
+
+	/* objects which are not in a pack are sorted last */
+	for (i = 0; i < n && po[i].pack < npacks; i++) {
+		objend = pack_objectend(&packs[po[i].pack], po[i].offset);
+		if (po[i].pack == pack && po[i].offset <= end + PACKGAP) {
+			if (objend > end)
+				end = objend;
+			continue;
+		}
+		if (end > start)
+			posix_fadvise(packs[pack].fd, start, end - start,
+			              POSIX_FADV_WILLNEED);
+		pack = po[i].pack;
+		start = po[i].offset;
+		end = objend;
+	}
+	if (end > start)
+		posix_fadvise(packs[pack].fd, start, end - start,
+		              POSIX_FADV_WILLNEED);
+}
+
+/* write the row of a file or submodule in files.html */
+void
+filejob_emit(struct job *job)
+{
+	if (job->row)
+		fwrite(job->row, 1, job->rowlen, job->fp);
+}
+
+/* keep the row until all files are written in pack order */
+void
+filejob_keep(struct job *job)
+{
+	filerows[job->n].s = job->row;
+	filerows[job->n].len = job->rowlen;
+	filerows[job->n].fp = job->fp;
+	job->row = NULL;
+}
+
+/* write the rows of files.html kept by filejob_keep */
+void
+filerows_write(void)
+{
+	size_t i;
+
+	for (i = 0; i < nfilerows; i++) {
+		if (filerows[i].s)
+			fwrite(filerows[i].s, 1, filerows[i].len, filerows[i].fp);
+		free(filerows[i].s);
+	}
+	free(filerows);
+	filerows = NULL;
+	nfilerows = 0;
+}
+
+void
+blobjob_run(struct job *job)
 {
-	const git_tree_entry *entry = NULL;
-	git_submodule *module = NULL;
 	git_object *obj = NULL;
 	git_off_t filesize;
+	const char *entryname, *p;
+	char rawpath[PATH_MAX], tmp[PATH_MAX];
+	FILE *fp;
+	int lc, r;
+
+	if (git_object_lookup(&obj, repo, &(job->id), GIT_OBJ_BLOB))
+		return;
+	if ((entryname = strrchr(job->name, '/')))
+		entryname++;
+	else
+		entryname = job->name;
+
+	if (rawfiles) {
+		r = snprintf(rawpath, sizeof(rawpath), "raw/%s", job->name);
+		if (r < 0 || (size_t)r >= sizeof(rawpath))
+			errx(1, "path truncated: 'raw/%s'", job->name);
+		writeraw((git_blob *)obj, rawpath);
+	}
+
+	filesize = git_blob_rawsize((git_blob *)obj);
+	lc = writeblob(obj, job->path, rawfiles ? rawpath : NULL, entryname,
+	               filesize, job->attrs ? pathattr(&headoid, job->name) : 0);
+	git_object_free(obj);
+
+	if (!(fp = open_memstream(&(job->row), &(job->rowlen))))
+		err(1, "open_memstream");
+	/* the page of the directory is in tree/ with -n */
+	for (p = job->name, tmp[0] = '\0'; treepages && *p; p++) {
+		if (*p == '/' && strlcat(tmp, "../", sizeof(tmp)) >= sizeof(tmp))
+			errx(1, "path truncated: '../%s'", tmp);
+	}
+	fputs("<tr><td>", fp);
+	fputs(filemode(job->mode), fp);
+	fprintf(fp, "</td><td><a href=\"%s", tmp);
+	xmlencode(fp, job->path, strlen(job->path));
+	fputs("\">", fp);
+	if (treepages)
+		xmlencode(fp, entryname, strlen(entryname));
+	else
+		xmlencode(fp, job->name, strlen(job->name));
+	fputs("</a></td><td class=\"num\" align=\"right\">", fp);
+	if (lc > 0)
+		fprintf(fp, "%dL", lc);
+	else
+		fprintf(fp, "%juB", (uintmax_t)filesize);
+	fputs("</td></tr>\n", fp);
+	fclose(fp);
+}
+
+/* row of a submodule: its pinned commit and url from .gitmodules */
+void
+printsubmodule(FILE *fp, const char *path, const git_oid *id)
+{
+	struct submodule key, *sm;
 	const char *entryname;
-	char filepath[PATH_MAX], entrypath[PATH_MAX];
+	char oid[13];
+
+	if (!treepages || !(entryname = strrchr(path, '/')))
+		entryname = path;
+	else
+		entryname++;
+
+	key.path = (char *)path;
+	sm = bsearch(&key, submodules, nsubmodules, sizeof(*submodules),
+	             submodule_cmp);
+	if (sm) {
+		sm->id = *id;
+		sm->found = 1;
+	}
+
+	git_oid_tostr(oid, sizeof(oid), id);
+	fputs("<tr><td>m---------</td><td>", fp);
+	if (sm) {
+		fprintf(fp, "<a href=\"%ssubmodules.html#", relpath);
+		xmlencode(fp, path, strlen(path));
+		fputs("\">", fp);
+	}
+	xmlencode(fp, entryname, strlen(entryname));
+	if (sm)
+		fputs("</a>", fp);
+	fprintf(fp, " @ %s", oid);
+	if (sm && sm->url) {
+		fputs(" (", fp);
+		xmlencode(fp, sm->url, strlen(sm->url));
+		fputc(')', fp);
+	}
+	fputs("</td><td class=\"num\" align=\"right\"></td></tr>\n", fp);
+}
+
+void
+writefileshead(FILE *fp)
+{
+	fputs("<table id=\"files\"><thead>\n<tr>"
+	      "<td><b>Mode</b></td><td><b>Name</b></td>"
+	      "<td class=\"num\" align=\"right\"><b>Size</b></td>"
+	      "</tr>\n</thead><tbody>\n", fp);
+}
+
+/* page of a directory: the rows written to its memory stream by the jobs
+   of its entries */
+void
+treejob_emit(struct job *job)
+{
+	char tmp[PATH_MAX] = "", *p;
+	FILE *fp;
+
+	if (fclose(job->fp))
+		err(1, "fclose: '%s'", job->path);
+	if (pagedir(job->path))
+		err(1, "mkdir: '%s'", job->path);
+	for (p = job->path; *p; p++) {
+		if (*p == '/' && strlcat(tmp, "../", sizeof(tmp)) >= sizeof(tmp))
+			errx(1, "path truncated: '../%s'", tmp);
+	}
+	relpath = tmp;
+
+	fp = pageopen(job->path, &(job->id));
+	writeheader(fp, job->name);
+	writefileshead(fp);
+	/* parent directory */
+	fprintf(fp, "<tr><td>d---------</td><td><a href=\"%s", relpath);
+	if ((p = strrchr(job->name, '/'))) {
+		fputs("tree/", fp);
+		xmlencode(fp, job->name, p - job->name);
+		fputs(".html", fp);
+	} else {
+		fputs("files.html", fp);
+	}
+	fputs("\">..</a></td><td class=\"num\" align=\"right\"></td></tr>\n", fp);
+	fwrite(job->row, 1, job->rowlen, fp);
+	fputs("</tbody></table>", fp);
+	writefooter(fp);
+	pageclose(fp);
+
+	relpath = "";
+}
+
+/* keep the pages of a directory and of all below it when the source of
+   its page, made of its tree and the state of the pages, is the same as in
+   the last run */
+int
+treekeep(const git_oid *source, const char *path, const char *page)
+{
+	struct manifestentry *e;
+	char dir[PATH_MAX], bpath[PATH_MAX], oid[GIT_OID_HEXSZ + 1];
+	const char *prefixes[] = { "tree", "file", "raw" };
+	size_t i, j, len;
+
+	/* the attribute files outside the trees can change any page */
+	if (!manifestfile || attrglobal || !(e = manifest_find(page)) ||
+	    git_oid_cmp(&(e->source), source) || !pageexists(page))
+		return 0;
+	/* the commits of submodules are read from the tree for
+	   submodules.html */
+	len = strlen(path);
+	for (i = 0; i < nsubmodules; i++)
+		if (!strncmp(submodules[i].path, path, len) &&
+		    submodules[i].path[len] == '/')
+			return 0;
+
+	e->seen = 1;
+	for (j = 0; j < sizeof(prefixes) / sizeof(*prefixes); j++) {
+		if (j == 2 && !rawfiles)
+			break;
+		if (snprintf(dir, sizeof(dir), "%s/%s/", prefixes[j], path) >=
+		    (int)sizeof(dir))
+			errx(1, "path truncated: '%s/%s/'", prefixes[j], path);
+		len = strlen(dir);
+		for (i = manifest_lower(dir); i < nmanifest &&
+		     !strncmp(manifest[i].path, dir, len); i++) {
+			manifest[i].seen = 1;
+			/* the raw files are links to the stored blobs */
+			if (j == 2 && !archivefile) {
+				git_oid_tostr(oid, sizeof(oid), &(manifest[i].source));
+				joinpath(bpath, sizeof(bpath), "blob", oid);
+				manifest_keep(bpath);
+			}
+		}
+	}
+	return 1;
+}
+
+/* submit a job per file and submodule, or collect them in -p mode. With -n
+   the rows of a directory are written to its own page */
+int
+writefilestree(FILE *fp, git_tree *tree, const char *path,
+               const git_oid *attrid)
+{
+	const git_tree_entry *entry = NULL;
+	git_tree *subtree = NULL;
+	struct job *job, *tjob;
+	const char *entryname, *p;
+	char entrypath[PATH_MAX], tmp[PATH_MAX] = "";
 	size_t count, i;
-	int lc, r, ret;
+	unsigned char buf[3 * GIT_OID_RAWSZ];
+	git_oid attrs;
+	int r, ret;
+	FILE *mfp;
+
+	/* relative path to the top from the page of this directory */
+	for (p = path; treepages && *p; p++) {
+		if (*p == '/' && strlcat(tmp, "../", sizeof(tmp)) >= sizeof(tmp))
+			errx(1, "path truncated: '../%s'", tmp);
+	}
+	if (treepages && path[0] && strlcat(tmp, "../", sizeof(tmp)) >= sizeof(tmp))
+		errx(1, "path truncated: '../%s'", tmp);
+
+	/* attribute files of this directory and above: the hash of their ids,
+	   NULL if none */
+	if ((entry = git_tree_entry_byname(tree, ".gitattributes"))) {
+		memcpy(buf, (attrid ? attrid : &zerooid)->id, GIT_OID_RAWSZ);
+		memcpy(buf + GIT_OID_RAWSZ, git_tree_entry_id(entry)->id,
+		       GIT_OID_RAWSZ);
+		if (git_odb_hash(&attrs, buf, 2 * GIT_OID_RAWSZ, GIT_OBJ_BLOB))
+			errx(1, "hash: '%s'", path);
+		attrid = &attrs;
+	}
 
 	count = git_tree_entrycount(tree);
 	for (i = 0; i < count; i++) {
@@ -892,56 +3657,143 @@ writefilestree(FILE *fp, git_tree *tree, const char *path)
 			return -1;
 		joinpath(entrypath, sizeof(entrypath), path, entryname);
 
-		r = snprintf(filepath, sizeof(filepath), "file/%s.html",
-		         entrypath);
-		if (r < 0 || (size_t)r >= sizeof(filepath))
-			errx(1, "path truncated: 'file/%s.html'", entrypath);
-
-		if (!git_tree_entry_to_object(&obj, repo, entry)) {
-			switch (git_object_type(obj)) {
-			case GIT_OBJ_BLOB:
+		switch (git_tree_entry_type(entry)) {
+		case GIT_OBJ_BLOB:
+			job = job_new(blobjob_run, filejob_emit, fp);
+			break;
+		case GIT_OBJ_TREE:
+			if (treepages) {
+				job = job_new(NULL, filejob_emit, fp);
+				if (!(mfp = open_memstream(&(job->row), &(job->rowlen))))
+					err(1, "open_memstream");
+				fprintf(mfp, "<tr><td>d---------</td><td><a href=\"%stree/", tmp);
+				xmlencode(mfp, entrypath, strlen(entrypath));
+				fputs(".html\">", mfp);
+				xmlencode(mfp, entryname, strlen(entryname));
+				fputs("</a></td><td class=\"num\" align=\"right\"></td></tr>\n", mfp);
+				fclose(mfp);
 				break;
-			case GIT_OBJ_TREE:
-				/* NOTE: recurses */
-				ret = writefilestree(fp, (git_tree *)obj,
-				                     entrypath);
-				git_object_free(obj);
-				if (ret)
-					return ret;
-				continue;
-			default:
-				git_object_free(obj);
-				continue;
 			}
+			if (git_tree_lookup(&subtree, repo, git_tree_entry_id(entry)))
+				continue;
+			/* NOTE: recurses */
+			ret = writefilestree(fp, subtree, entrypath, attrid);
+			git_tree_free(subtree);
+			if (ret)
+				return ret;
+			continue;
+		case GIT_OBJ_COMMIT:
+			job = job_new(NULL, filejob_emit, fp);
+			if (!(mfp = open_memstream(&(job->row), &(job->rowlen))))
+				err(1, "open_memstream");
+			relpath = tmp;
+			printsubmodule(mfp, entrypath, git_tree_entry_id(entry));
+			relpath = "";
+			fclose(mfp);
+			break;
+		default:
+			continue;
+		}
+
+		job->id = *git_tree_entry_id(entry);
+		job->mode = git_tree_entry_filemode(entry);
+		job->attrs = attrglobal || attrid;
+		strlcpy(job->name, entrypath, sizeof(job->name));
+		r = snprintf(job->path, sizeof(job->path), "file/%s.html",
+		         entrypath);
+		if (r < 0 || (size_t)r >= sizeof(job->path))
+			errx(1, "path truncated: 'file/%s.html'", entrypath);
 
-			filesize = git_blob_rawsize((git_blob *)obj);
-			lc = writeblob(obj, filepath, entryname, filesize);
-
-			fputs("<tr><td>", fp);
-			fputs(filemode(git_tree_entry_filemode(entry)), fp);
-			fprintf(fp, "</td><td><a href=\"%s", relpath);
-			xmlencode(fp, filepath, strlen(filepath));
-			fputs("\">", fp);
-			xmlencode(fp, entrypath, strlen(entrypath));
-			fputs("</a></td><td class=\"num\" align=\"right\">", fp);
-			if (lc > 0)
-				fprintf(fp, "%dL", lc);
-			else
-				fprintf(fp, "%juB", (uintmax_t)filesize);
-			fputs("</td></tr>\n", fp);
-			git_object_free(obj);
-		} else if (!git_submodule_lookup(&module, repo, entryname)) {
-			fprintf(fp, "<tr><td>m---------</td><td><a href=\"%sfile/.gitmodules.html\">",
-				relpath);
-			xmlencode(fp, entrypath, strlen(entrypath));
-			git_submodule_free(module);
-			fputs("</a></td><td class=\"num\" align=\"right\"></td></tr>\n", fp);
+		if (packorder) {
+			if (!(packfiles = reallocarray(packfiles, npackfiles + 1,
+			    sizeof(*packfiles))))
+				err(1, "realloc");
+			packfiles[npackfiles].job = job;
+			job->emit = filejob_keep;
+			job->n = npackfiles++;
+		} else {
+			job_submit(job);
+		}
+
+		if (git_tree_entry_type(entry) != GIT_OBJ_TREE)
+			continue;
+
+		/* page of the directory, not written again if its tree, the
+		   attribute files above it and the options and metadata of
+		   the pages did not change: the source of the page */
+		tjob = job_new(NULL, treejob_emit, NULL);
+		memcpy(buf, git_tree_entry_id(entry)->id, GIT_OID_RAWSZ);
+		memcpy(buf + GIT_OID_RAWSZ, (attrid ? attrid : &zerooid)->id,
+		       GIT_OID_RAWSZ);
+		memcpy(buf + 2 * GIT_OID_RAWSZ, pagestate.id, GIT_OID_RAWSZ);
+		if (git_odb_hash(&(tjob->id), buf, sizeof(buf), GIT_OBJ_BLOB))
+			errx(1, "hash: '%s'", entrypath);
+		strlcpy(tjob->name, entrypath, sizeof(tjob->name));
+		r = snprintf(tjob->path, sizeof(tjob->path), "tree/%s.html",
+		         entrypath);
+		if (r < 0 || (size_t)r >= sizeof(tjob->path))
+			errx(1, "path truncated: 'tree/%s.html'", entrypath);
+		if (treekeep(&(tjob->id), entrypath, tjob->path) ||
+		    git_tree_lookup(&subtree, repo, git_tree_entry_id(entry))) {
+			free(tjob);
+			continue;
+		}
+		if (!(tjob->fp = open_memstream(&(tjob->row), &(tjob->rowlen))))
+			err(1, "open_memstream");
+		/* NOTE: recurses */
+		ret = writefilestree(tjob->fp, subtree, entrypath, attrid);
+		git_tree_free(subtree);
+
+		/* in -p mode after the rows, which are written at the end */
+		if (packorder) {
+			if (!(treejobs = reallocarray(treejobs, ntreejobs + 1,
+			    sizeof(*treejobs))))
+				err(1, "realloc");
+			treejobs[ntreejobs++] = tjob;
+		} else {
+			job_submit(tjob);
 		}
+		if (ret)
+			return ret;
 	}
 
 	return 0;
 }
 
+/* write the files in the order of their objects in the packs after
+   reading them ahead, the rows are written in tree order */
+void
+writefilespackorder(void)
+{
+	size_t i;
+
+	packs_open();
+	for (i = 0; i < npackfiles; i++)
+		pack_find(&(packfiles[i].job->id), &(packfiles[i].pack),
+		          &(packfiles[i].offset));
+	qsort(packfiles, npackfiles, sizeof(*packfiles), packorder_cmp);
+	packs_readahead(packfiles, npackfiles);
+
+	if (npackfiles && !(filerows = calloc(npackfiles, sizeof(*filerows))))
+		err(1, "calloc");
+	nfilerows = npackfiles;
+	for (i = 0; i < npackfiles; i++)
+		job_submit(packfiles[i].job);
+	jobs_flush();
+	filerows_write();
+	for (i = 0; i < ntreejobs; i++)
+		job_submit(treejobs[i]);
+	free(treejobs);
+	treejobs = NULL;
+	ntreejobs = 0;
+
+	/* the file descriptors are only used for the read ahead */
+	packs_close();
+	free(packfiles);
+	packfiles = NULL;
+	npackfiles = 0;
+}
+
 int
 writefiles(FILE *fp, const git_oid *id)
 {
@@ -949,16 +3801,15 @@ writefiles(FILE *fp, const git_oid *id)
 	git_commit *commit = NULL;
 	int ret = -1;
 
-	fputs("<table id=\"files\"><thead>\n<tr>"
-	      "<td><b>Mode</b></td><td><b>Name</b></td>"
-	      "<td class=\"num\" align=\"right\"><b>Size</b></td>"
-	      "</tr>\n</thead><tbody>\n", fp);
+	writefileshead(fp);
 
 	if (!git_commit_lookup(&commit, repo, id) &&
 	    !git_commit_tree(&tree, commit))
-		ret = writefilestree(fp, tree, "");
+		ret = writefilestree(fp, tree, "", NULL);
+	if (packorder)
+		writefilespackorder();
 
-	fputs("</tbody></table>", fp);
+	job_call(tableend_emit, fp);
 
 	git_commit_free(commit);
 	git_tree_free(tree);
@@ -966,6 +3817,36 @@ writefiles(FILE *fp, const git_oid *id)
 	return ret;
 }
 
+/* submodules of .gitmodules with their commit in the tree of HEAD */
+void
+writesubmodules(FILE *fp)
+{
+	struct submodule *sm;
+	char oid[GIT_OID_HEXSZ + 1];
+	size_t i;
+
+	fputs("<table id=\"submodules\"><thead>\n<tr>"
+	      "<td><b>Path</b></td><td><b>Commit</b></td><td><b>URL</b></td>"
+	      "</tr>\n</thead><tbody>\n", fp);
+	for (i = 0; i < nsubmodules; i++) {
+		sm = &submodules[i];
+		fputs("<tr id=\"", fp);
+		xmlencode(fp, sm->path, strlen(sm->path));
+		fputs("\"><td>", fp);
+		xmlencode(fp, sm->path, strlen(sm->path));
+		fputs("</td><td>", fp);
+		if (sm->found) {
+			git_oid_tostr(oid, sizeof(oid), &(sm->id));
+			fputs(oid, fp);
+		}
+		fputs("</td><td>", fp);
+		if (sm->url)
+			xmlencode(fp, sm->url, strlen(sm->url));
+		fputs("</td></tr>\n", fp);
+	}
+	fputs("</tbody></table>", fp);
+}
+
 int
 refs_cmp(const void *v1, const void *v2)
 {
@@ -981,18 +3862,396 @@ refs_cmp(const void *v1, const void *v2)
 }
 
 int
-writerefs(FILE *fp)
+refcache_cmp(const void *v1, const void *v2)
 {
-	struct commitinfo *ci;
-	const git_oid *id = NULL;
+	return strcmp(((struct refcache *)v1)->name,
+	              ((struct refcache *)v2)->name);
+}
+
+/* latest modification time of the loose references: git creates, updates
+   and removes them by renaming or unlinking files in these directories */
+void
+refsnewest(const char *path, struct timespec *ts)
+{
+	DIR *dp;
+	struct dirent *d;
+	struct stat st;
+	char subpath[PATH_MAX];
+
+	if (stat(path, &st))
+		return;
+	if (st.st_mtim.tv_sec > ts->tv_sec ||
+	    (st.st_mtim.tv_sec == ts->tv_sec && st.st_mtim.tv_nsec > ts->tv_nsec))
+		*ts = st.st_mtim;
+	if (!S_ISDIR(st.st_mode) || !(dp = opendir(path)))
+		return;
+	while ((d = readdir(dp))) {
+		if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+			continue;
+		joinpath(subpath, sizeof(subpath), path, d->d_name);
+		refsnewest(subpath, ts);
+	}
+	closedir(dp);
+}
+
+/* state of packed-refs, the loose references and the page header, if it
+   is the same as in the cache no reference nor metadata changed since the
+   last run */
+void
+getrefsstate(char *buf, size_t bufsiz)
+{
+	struct stat st;
+	struct timespec loose = { 0, 0 };
+	git_oid header;
+	char path[PATH_MAX], hash[GIT_OID_HEXSZ + 1];
+
+	joinpath(path, sizeof(path), git_repository_path(repo), "packed-refs");
+	if (stat(path, &st))
+		memset(&st, 0, sizeof(st));
+	joinpath(path, sizeof(path), git_repository_path(repo), "refs");
+	refsnewest(path, &loose);
+	headerhash(&header);
+	git_oid_tostr(hash, sizeof(hash), &header);
+
+	snprintf(buf, bufsiz, "%lld.%09ld %lld %lld.%09ld %s",
+	         (long long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec,
+	         (long long)st.st_size,
+	         (long long)loose.tv_sec, (long)loose.tv_nsec, hash);
+}
+
+/* read the references cache (does not need to exist), a line per reference:
+   target peeled time offset name author */
+void
+refcache_read(void)
+{
+	struct refcache *rc;
+	FILE *fp;
+	char *line = NULL, *p, target[GIT_OID_HEXSZ + 1], peeled[GIT_OID_HEXSZ + 1];
+	size_t linesiz = 0;
+	long long t;
+	int offset, n;
+
+	if (!(fp = fopen(refcachefile, "r")))
+		return;
+	if (getline(&line, &linesiz, fp) > 0) {
+		line[strcspn(line, "\n")] = '\0';
+		strlcpy(refcachestate, line, sizeof(refcachestate));
+	}
+	while (getline(&line, &linesiz, fp) > 0) {
+		line[strcspn(line, "\n")] = '\0';
+		if (sscanf(line, "%40s %40s %lld %d %n",
+		    target, peeled, &t, &offset, &n) != 4 ||
+		    !(p = strchr(line + n, ' ')))
+			errx(1, "%s: invalid line", refcachefile);
+		*p++ = '\0';
+
+		if (!(refcache = reallocarray(refcache, nrefcache + 1, sizeof(*refcache))))
+			err(1, "realloc");
+		rc = &refcache[nrefcache];
+		memset(rc, 0, sizeof(*rc));
+		if (git_oid_fromstr(&(rc->target), target) ||
+		    git_oid_fromstr(&(rc->peeled), peeled))
+			errx(1, "%s: invalid object id", refcachefile);
+		rc->when.time = (git_time_t)t;
+		rc->when.offset = offset;
+		if (!(rc->name = strdup(line + n)) || !(rc->author = strdup(p)))
+			err(1, "strdup");
+		nrefcache++;
+	}
+	free(line);
+	fclose(fp);
+
+	qsort(refcache, nrefcache, sizeof(*refcache), refcache_cmp);
+}
+
+void
+refcache_free(void)
+{
+	size_t i;
+
+	for (i = 0; i < nrefcache; i++) {
+		free(refcache[i].name);
+		free(refcache[i].author);
+	}
+	free(refcache);
+	refcache = NULL;
+	nrefcache = 0;
+}
+
+/* peel the target of the reference and read the date and author of the
+   commit: the header of the commit is enough, no diff is needed */
+void
+refjob_run(struct job *job)
+{
+	git_object *obj = NULL, *peeled = NULL;
+	const git_signature *author;
+
+	if (git_object_lookup(&obj, repo, &(job->id), GIT_OBJ_ANY))
+		goto err;
+	if (git_object_type(obj) == GIT_OBJ_TAG) {
+		if (git_tag_peel(&peeled, (git_tag *)obj))
+			goto err;
+	} else {
+		peeled = obj;
+		obj = NULL;
+	}
+	if (git_object_type(peeled) != GIT_OBJ_COMMIT ||
+	    !(author = git_commit_author((git_commit *)peeled)))
+		goto err;
+
+	job->peeled = *git_object_id(peeled);
+	job->when = author->when;
+	if (!(job->author = strdup(author->name)))
+		err(1, "strdup");
+	git_object_free(peeled);
+	git_object_free(obj);
+	return;
+err:
+	job->error = 1;
+	git_object_free(peeled);
+	git_object_free(obj);
+}
+
+void
+refjob_emit(struct job *job)
+{
+	const char *titles[] = { "Branches", "Tags" };
+	const char *ids[] = { "branches", "tags" };
+	char target[GIT_OID_HEXSZ + 1], peeled[GIT_OID_HEXSZ + 1];
+
+	/* the table ends at the first reference which failed */
+	if (refsstop || (refsstop = job->error))
+		return;
+
+	/* print header if it has an entry (first). */
+	if (++refsrows == 1) {
+		fprintf(job->fp, "<h2>%s</h2><table id=\"%s\">"
+		        "<thead>\n<tr><td><b>Name</b></td>"
+		        "<td><b>Last commit date</b></td>"
+		        "<td><b>Author</b></td>\n</tr>\n"
+		        "</thead><tbody>\n",
+		         titles[job->n], ids[job->n]);
+	}
+	fputs("<tr><td>", job->fp);
+	if (job->n == 1) {
+		fprintf(job->fp, "<a href=\"%stag/", relpath);
+		xmlencode(job->fp, job->name, strlen(job->name));
+		fputs(".html\">", job->fp);
+		xmlencode(job->fp, job->name, strlen(job->name));
+		fputs("</a>", job->fp);
+
+		if (!(tags = reallocarray(tags, ntags + 1, sizeof(*tags))))
+			err(1, "realloc");
+		memset(&tags[ntags], 0, sizeof(*tags));
+		if (!(tags[ntags].name = strdup(job->name)) ||
+		    !(tags[ntags].refname = strdup(job->path)))
+			err(1, "strdup");
+		tags[ntags].target = job->id;
+		tags[ntags].peeled = job->peeled;
+		tags[ntags].time = job->when.time;
+		ntags++;
+	} else {
+		xmlencode(job->fp, job->name, strlen(job->name));
+	}
+	fputs("</td><td>", job->fp);
+	printtimeshort(job->fp, &(job->when));
+	fputs("</td><td>", job->fp);
+	xmlencode(job->fp, job->author, strlen(job->author));
+	fputs("</td></tr>\n", job->fp);
+
+	if (wrefsfp) {
+		git_oid_tostr(target, sizeof(target), &(job->id));
+		git_oid_tostr(peeled, sizeof(peeled), &(job->peeled));
+		fprintf(wrefsfp, "%s %s %lld %d %s %s\n", target, peeled,
+		        (long long)job->when.time, job->when.offset,
+		        job->path, job->author);
+	}
+}
+
+void
+refsend_emit(struct job *job)
+{
+	/* table footer */
+	if (refsrows)
+		fputs("</tbody></table><br/>", job->fp);
+	refsrows = 0;
+	refsstop = 0;
+}
+
+void
+tagpath(char *buf, size_t bufsiz, const char *tagname)
+{
+	joinpath(buf, bufsiz, "tag", tagname);
+	if (strlcat(buf, ".html", bufsiz) >= bufsiz)
+		errx(1, "path truncated: '%s.html'", buf);
+}
+
+int
+tag_cmp(const void *v1, const void *v2)
+{
+	const struct tag *t1 = v1, *t2 = v2;
+
+	if (t1->time != t2->time)
+		return t1->time < t2->time ? -1 : 1;
+	return strcmp(t1->name, t2->name);
+}
+
+/* diffstat of the changes since the previous tag */
+void
+printtagdiffstat(FILE *fp, const struct tag *prev, git_commit *commit)
+{
+	git_commit *prevcommit = NULL;
+	git_tree *tree = NULL, *prevtree = NULL;
+	git_diff *diff = NULL;
+	git_diff_options opts;
+	git_diff_find_options fopts;
+	git_diff_stats *stats = NULL;
+	git_buf buf = { 0 };
+
+	if (git_commit_lookup(&prevcommit, repo, &(prev->peeled)) ||
+	    git_commit_tree(&prevtree, prevcommit) ||
+	    git_commit_tree(&tree, commit))
+		goto err;
+
+	git_diff_init_options(&opts, GIT_DIFF_OPTIONS_VERSION);
+	opts.flags |= GIT_DIFF_DISABLE_PATHSPEC_MATCH |
+	              GIT_DIFF_IGNORE_SUBMODULES |
+		      GIT_DIFF_INCLUDE_TYPECHANGE;
+	if (git_diff_tree_to_tree(&diff, repo, prevtree, tree, &opts))
+		goto err;
+	if (git_diff_find_init_options(&fopts, GIT_DIFF_FIND_OPTIONS_VERSION))
+		goto err;
+	fopts.flags |= GIT_DIFF_FIND_RENAMES | GIT_DIFF_FIND_COPIES |
+	               GIT_DIFF_FIND_EXACT_MATCH_ONLY;
+	if (git_diff_find_similar(diff, &fopts) ||
+	    git_diff_get_stats(&stats, diff) ||
+	    git_diff_stats_to_buf(&buf, stats, GIT_DIFF_STATS_FULL |
+	    GIT_DIFF_STATS_INCLUDE_SUMMARY, 80))
+		goto err;
+
+	fputs("<p><b>Diffstat since</b> <a href=\"", fp);
+	fprintf(fp, "%stag/", relpath);
+	xmlencode(fp, prev->name, strlen(prev->name));
+	fputs(".html\">", fp);
+	xmlencode(fp, prev->name, strlen(prev->name));
+	fputs("</a>:</p>\n<pre>", fp);
+	xmlencode(fp, buf.ptr, buf.size);
+	fputs("</pre>\n", fp);
+
+err:
+	git_buf_dispose(&buf);
+	git_diff_stats_free(stats);
+	git_diff_free(diff);
+	git_tree_free(tree);
+	git_tree_free(prevtree);
+	git_commit_free(prevcommit);
+}
+
+/* source of the page of a tag: the tag, its previous tag, the page
+   header and whether its commit has a page */
+void
+tagsource(git_oid *source, const struct tag *t, const struct tag *prev,
+          const git_oid *header)
+{
+	char buf[3 * PATH_MAX], target[GIT_OID_HEXSZ + 1], hash[GIT_OID_HEXSZ + 1];
+	char prevtarget[GIT_OID_HEXSZ + 1] = "";
+
+	git_oid_tostr(target, sizeof(target), &(t->target));
+	git_oid_tostr(hash, sizeof(hash), header);
+	if (prev)
+		git_oid_tostr(prevtarget, sizeof(prevtarget), &(prev->target));
+	snprintf(buf, sizeof(buf), "tag %s %s prev %s %s header %s commit %d",
+	         target, t->name, prevtarget, prev ? prev->name : "", hash,
+	         oidset_has(&pages, &(t->peeled)));
+	if (git_odb_hash(source, buf, strlen(buf), GIT_OBJ_BLOB))
+		errx(1, "hash: tag %s", t->name);
+}
+
+/* page of a tag: tagger, message and commit of the tag */
+void
+tagjob_run(struct job *job)
+{
+	const struct tag *t = &tags[job->n];
+	const git_signature *tagger = NULL;
+	const char *msg = NULL;
 	git_object *obj = NULL;
+	git_commit *commit = NULL;
+	char tmp[PATH_MAX], cpath[PATH_MAX], oid[GIT_OID_HEXSZ + 1];
+	const char *p;
+	FILE *fp;
+
+	if (git_object_lookup(&obj, repo, &(t->target), GIT_OBJ_ANY) ||
+	    git_commit_lookup(&commit, repo, &(t->peeled)))
+		goto err;
+	if (git_object_type(obj) == GIT_OBJ_TAG) {
+		tagger = git_tag_tagger((git_tag *)obj);
+		msg = git_tag_message((git_tag *)obj);
+	}
+
+	if (pagedir(job->path))
+		goto err;
+	for (p = job->path, tmp[0] = '\0'; *p; p++) {
+		if (*p == '/' && strlcat(tmp, "../", sizeof(tmp)) >= sizeof(tmp))
+			errx(1, "path truncated: '../%s'", tmp);
+	}
+	relpath = tmp;
+
+	fp = pageopen(job->path, &(t->source));
+	writeheader(fp, t->name);
+	fputs("<pre><b>tag</b> ", fp);
+	xmlencode(fp, t->name, strlen(t->name));
+	git_oid_tostr(oid, sizeof(oid), &(t->peeled));
+	/* only commits in the history of HEAD have a page */
+	if (oidset_has(&pages, &(t->peeled))) {
+		commitpath(cpath, sizeof(cpath), oid, ".html");
+		fprintf(fp, "\n<b>commit</b> <a href=\"%s%s\">%s</a>\n",
+		        relpath, cpath, oid);
+	} else {
+		fprintf(fp, "\n<b>commit</b> %s\n", oid);
+	}
+	if (tagger) {
+		fputs("<b>Tagger:</b> ", fp);
+		xmlencode(fp, tagger->name, strlen(tagger->name));
+		fputs(" &lt;<a href=\"mailto:", fp);
+		xmlencode(fp, tagger->email, strlen(tagger->email));
+		fputs("\">", fp);
+		xmlencode(fp, tagger->email, strlen(tagger->email));
+		fputs("</a>&gt;\n<b>Date:</b>   ", fp);
+		printtime(fp, &(tagger->when));
+		fputc('\n', fp);
+	}
+	if (msg) {
+		fputc('\n', fp);
+		xmlencode(fp, msg, strlen(msg));
+		fputc('\n', fp);
+	}
+	fputs("</pre>\n", fp);
+	if (job->n > 0)
+		printtagdiffstat(fp, &tags[job->n - 1], commit);
+	writefooter(fp);
+	pageclose(fp);
+
+	relpath = "";
+err:
+	git_commit_free(commit);
+	git_object_free(obj);
+}
+
+int
+writerefs(FILE *fp)
+{
+	struct job *job;
+	struct refcache key, *rc;
+	struct manifestentry *e;
+	struct tag oldtag;
+	const git_oid *id;
+	git_oid header;
 	git_reference *dref = NULL, *r, *ref = NULL;
 	git_reference_iterator *it = NULL;
 	git_reference **refs = NULL;
-	size_t count, i, j, refcount;
-	const char *titles[] = { "Branches", "Tags" };
-	const char *ids[] = { "branches", "tags" };
-	const char *name;
+	size_t i, j, refcount;
+	char path[PATH_MAX], *p;
+	int headerchanged;
 
 	if (git_reference_iterator_new(&it, repo))
 		return -1;
@@ -1008,7 +4267,7 @@ writerefs(FILE *fp)
 	qsort(refs, refcount, sizeof(git_reference *), refs_cmp);
 
 	for (j = 0; j < 2; j++) {
-		for (i = 0, count = 0; i < refcount; i++) {
+		for (i = 0; i < refcount; i++) {
 			if (!(git_reference_is_branch(refs[i]) && j == 0) &&
 			    !(git_reference_is_tag(refs[i]) && j == 1))
 				continue;
@@ -1025,52 +4284,100 @@ writerefs(FILE *fp)
 			default:
 				continue;
 			}
-			if (!git_reference_target(r) ||
-			    git_reference_peel(&obj, r, GIT_OBJ_ANY))
-				goto err;
-			if (!(id = git_object_id(obj)))
+			if (!(id = git_reference_target(r)))
 				goto err;
-			if (!(ci = commitinfo_getbyoid(id)))
-				break;
 
-			/* print header if it has an entry (first). */
-			if (++count == 1) {
-				fprintf(fp, "<h2>%s</h2><table id=\"%s\">"
-			                "<thead>\n<tr><td><b>Name</b></td>"
-				        "<td><b>Last commit date</b></td>"
-				        "<td><b>Author</b></td>\n</tr>\n"
-				        "</thead><tbody>\n",
-				         titles[j], ids[j]);
+			/* the commit is known if the target did not change */
+			key.name = (char *)git_reference_name(refs[i]);
+			rc = bsearch(&key, refcache, nrefcache, sizeof(*refcache),
+			             refcache_cmp);
+			if (rc && !git_oid_cmp(&(rc->target), id)) {
+				job = job_new(NULL, refjob_emit, fp);
+				job->peeled = rc->peeled;
+				job->when = rc->when;
+				if (!(job->author = strdup(rc->author)))
+					err(1, "strdup");
+			} else {
+				job = job_new(refjob_run, refjob_emit, fp);
 			}
+			job->id = *id;
+			job->n = j;
+			strlcpy(job->path, git_reference_name(refs[i]), sizeof(job->path));
+			strlcpy(job->name, git_reference_shorthand(r), sizeof(job->name));
+			job_submit(job);
 
-			relpath = "";
-			name = git_reference_shorthand(r);
-
-			fputs("<tr><td>", fp);
-			xmlencode(fp, name, strlen(name));
-			fputs("</td><td>", fp);
-			if (ci->author)
-				printtimeshort(fp, &(ci->author->when));
-			fputs("</td><td>", fp);
-			if (ci->author)
-				xmlencode(fp, ci->author->name, strlen(ci->author->name));
-			fputs("</td></tr>\n", fp);
-
-			relpath = "../";
-
-			commitinfo_free(ci);
-			git_object_free(obj);
-			obj = NULL;
 			git_reference_free(dref);
 			dref = NULL;
 		}
-		/* table footer */
-		if (count)
-			fputs("</tbody></table><br/>", fp);
+		job_call(refsend_emit, fp);
+	}
+
+	/* the previous tag of each tag is known once all tags are read */
+	jobs_flush();
+	qsort(tags, ntags, sizeof(*tags), tag_cmp);
+
+	/* the header of the pages is the last field of the state of the
+	   references */
+	headerhash(&header);
+	p = strrchr(refcachestate, ' ');
+	headerchanged = !p || strcmp(p, strrchr(refsstate, ' '));
+
+	/* a tag page is written again only if the tag moved, its previous
+	   tag or the page header changed: with a manifest its source tells,
+	   with a cache the targets of the last run, else it is always
+	   written */
+	for (i = 0; i < ntags; i++) {
+		tagsource(&(tags[i].source), &tags[i], i ? &tags[i - 1] : NULL,
+		          &header);
+		key.name = tags[i].refname;
+		rc = bsearch(&key, refcache, nrefcache, sizeof(*refcache),
+		             refcache_cmp);
+		if (rc && !git_oid_cmp(&(rc->target), &(tags[i].target)))
+			rc->seen = 1;
+		tagpath(path, sizeof(path), tags[i].name);
+		/* tag pages link to commit pages */
+		if (relayout || !pageexists(path)) {
+			tags[i].write = 1;
+		} else if (manifestfile) {
+			if (!(e = manifest_find(path)) ||
+			    git_oid_cmp(&(e->source), &(tags[i].source)))
+				tags[i].write = 1;
+		} else if (!cachefile || headerchanged) {
+			tags[i].write = 1;
+		} else if (!(rc && rc->seen)) {
+			tags[i].write = 1;
+			if (i + 1 < ntags)
+				tags[i + 1].write = 1;
+		}
+	}
+	/* with a manifest the source of the next tag changed already */
+	for (i = 0; i < nrefcache && !manifestfile; i++) {
+		if (refcache[i].seen || strncmp(refcache[i].name, "refs/tags/", 10))
+			continue;
+		/* removed or moved tag: the next tag at its old place */
+		oldtag.name = refcache[i].name + 10;
+		oldtag.time = refcache[i].when.time;
+		for (j = 0; j < ntags; j++) {
+			if (tag_cmp(&tags[j], &oldtag) > 0) {
+				tags[j].write = 1;
+				break;
+			}
+		}
+	}
+
+	for (i = 0; i < ntags; i++) {
+		tagpath(path, sizeof(path), tags[i].name);
+		if (!tags[i].write) {
+			manifest_keep(path);
+			continue;
+		}
+		job = job_new(tagjob_run, NULL, NULL);
+		job->n = i;
+		strlcpy(job->path, path, sizeof(job->path));
+		job_submit(job);
 	}
 
 err:
-	git_object_free(obj);
 	git_reference_free(dref);
 
 	for (i = 0; i < refcount; i++)
@@ -1083,7 +4390,10 @@ err:
 void
 usage(char *argv0)
 {
-	fprintf(stderr, "%s [-c cachefile | -l commits] repodir\n", argv0);
+	fprintf(stderr, "%s [-fgnprst] [-b filetime[:committime]] [-x algorithm] "
+	        "[-c cachefile | -l commits] [-d storedir] "
+	        "[-m manifest | -a archive] [-u changes] repodir\n", argv0);
+	fprintf(stderr, "%s -z archive\n", argv0);
 	exit(1);
 }
 
@@ -1091,12 +4401,17 @@ int
 main(int argc, char *argv[])
 {
 	git_object *obj = NULL;
+	git_tree *tree = NULL;
 	const git_oid *head = NULL;
-	mode_t mask;
-	FILE *fp, *fpread;
-	char path[PATH_MAX], repodirabs[PATH_MAX + 1], *p;
+	FILE *fp;
+	char repodirabs[PATH_MAX + 1], *p;
 	char tmppath[64] = "cache.XXXXXXXXXXXX", buf[BUFSIZ];
-	size_t n;
+	char refstmppath[64] = "refs.XXXXXXXXXXXX";
+	char manifesttmppath[64] = "manifest.XXXXXXXXXXXX";
+	char archivetmppath[64] = "archive.XXXXXXXXXXXX";
+	char indextmppath[64] = "index.XXXXXXXXXXXX";
+	char changestmppath[64] = "changes.XXXXXXXXXXXX";
+	size_t j;
 	int i, fd;
 
 	for (i = 1; i < argc; i++) {
@@ -1108,6 +4423,9 @@ main(int argc, char *argv[])
 			if (nlogcommits > 0 || i + 1 >= argc)
 				usage(argv[0]);
 			cachefile = argv[++i];
+			if (snprintf(refcachefile, sizeof(refcachefile), "%s.refs",
+			    cachefile) >= (int)sizeof(refcachefile))
+				errx(1, "path truncated: '%s.refs'", cachefile);
 		} else if (argv[i][1] == 'l') {
 			if (cachefile || i + 1 >= argc)
 				usage(argv[0]);
@@ -1116,10 +4434,84 @@ main(int argc, char *argv[])
 			if (argv[i][0] == '\0' || *p != '\0' ||
 			    nlogcommits <= 0 || errno)
 				usage(argv[0]);
+		} else if (argv[i][1] &&
+		           !argv[i][1 + strspn(argv[i] + 1, "fgnprst")]) {
+			/* flags without an argument, can be grouped as -fg */
+			for (p = argv[i] + 1; *p; p++) {
+				switch (*p) {
+				case 'f': fanout = 1; break;
+				case 'g': patches = 1; break;
+				case 'n': treepages = 1; break;
+				case 'p': packorder = 1; break;
+				case 'r': rawfiles = 1; break;
+				case 's': syncoutput = 1; break;
+				case 't': terse = 1; break;
+				}
+			}
+		} else if (argv[i][1] == 'b') {
+			if (i + 1 >= argc)
+				usage(argv[0]);
+			errno = 0;
+			filebudget = strtol(argv[++i], &p, 10);
+			if (*p == ':')
+				commitbudget = strtol(p + 1, &p, 10);
+			if (argv[i][0] == '\0' || *p != '\0' || filebudget < 0 ||
+			    commitbudget < 0 || errno)
+				usage(argv[0]);
+		} else if (argv[i][1] == 'x') {
+			if (i + 1 >= argc)
+				usage(argv[0]);
+			if (!strcmp(argv[++i], "patience"))
+				diffalgo = GIT_DIFF_PATIENCE;
+			else if (!strcmp(argv[i], "minimal"))
+				diffalgo = GIT_DIFF_MINIMAL;
+			else if (strcmp(argv[i], "myers"))
+				usage(argv[0]);
+		} else if (argv[i][1] == 'd') {
+			if (i + 1 >= argc)
+				usage(argv[0]);
+			storedir = argv[++i];
+		} else if (argv[i][1] == 'm') {
+			if (archivefile || i + 1 >= argc)
+				usage(argv[0]);
+			manifestfile = argv[++i];
+		} else if (argv[i][1] == 'a' || argv[i][1] == 'z') {
+			if (manifestfile || i + 1 >= argc)
+				usage(argv[0]);
+			compact = argv[i][1] == 'z';
+			archivefile = argv[++i];
+			if (snprintf(archiveindex, sizeof(archiveindex), "%s.idx",
+			    archivefile) >= (int)sizeof(archiveindex))
+				errx(1, "path truncated: '%s.idx'", archivefile);
+			manifestfile = archiveindex;
+		} else if (argv[i][1] == 'u') {
+			if (i + 1 >= argc)
+				usage(argv[0]);
+			changesfile = argv[++i];
 		}
 	}
-	if (!repodir)
+	/* compaction is a separate run, without a repository */
+	if (compact ? argc != 3 : !repodir)
 		usage(argv[0]);
+	/* for files written with mkstemp(3) */
+	umask((mask = umask(0)));
+
+	if (compact) {
+#ifdef __OpenBSD__
+		if (unveil(".", "rwc") == -1)
+			err(1, "unveil: .");
+		if (unveil(archivefile, "rwc") == -1)
+			err(1, "unveil: %s", archivefile);
+		if (unveil(archiveindex, "rwc") == -1)
+			err(1, "unveil: %s", archiveindex);
+		if (pledge("stdio rpath wpath cpath fattr", NULL) == -1)
+			err(1, "pledge");
+#endif
+		git_libgit2_init();
+		archive_compact(archivetmppath, indextmppath);
+		git_libgit2_shutdown();
+		return 0;
+	}
 
 	if (!realpath(repodir, repodirabs))
 		err(1, "realpath");
@@ -1133,8 +4525,18 @@ main(int argc, char *argv[])
 		err(1, "unveil: .");
 	if (cachefile && unveil(cachefile, "rwc") == -1)
 		err(1, "unveil: %s", cachefile);
-
-	if (cachefile) {
+	if (cachefile && unveil(refcachefile, "rwc") == -1)
+		err(1, "unveil: %s", refcachefile);
+	if (storedir && unveil(storedir, "rwc") == -1)
+		err(1, "unveil: %s", storedir);
+	if (manifestfile && unveil(manifestfile, "rwc") == -1)
+		err(1, "unveil: %s", manifestfile);
+	if (archivefile && unveil(archivefile, "rwc") == -1)
+		err(1, "unveil: %s", archivefile);
+	if (changesfile && unveil(changesfile, "rwc") == -1)
+		err(1, "unveil: %s", changesfile);
+
+	if (cachefile || manifestfile || changesfile) {
 		if (pledge("stdio rpath wpath cpath fattr", NULL) == -1)
 			err(1, "pledge");
 	} else {
@@ -1148,10 +4550,19 @@ main(int argc, char *argv[])
 		fprintf(stderr, "%s: cannot open repository\n", argv[0]);
 		return 1;
 	}
+	if (git_repository_odb(&odb, repo))
+		errx(1, "%s: cannot open object database", repodir);
+	attrglobal = globalattrfiles(&attrstate);
 
 	/* find HEAD */
-	if (!git_revparse_single(&obj, repo, "HEAD"))
-		head = git_object_id(obj);
+	if (!git_revparse_single(&obj, repo, "HEAD")) {
+		headoid = *git_object_id(obj);
+		head = &headoid;
+		if (git_object_type(obj) == GIT_OBJ_COMMIT &&
+		    !git_commit_tree(&tree, (git_commit *)obj))
+			findspecialfiles(tree);
+		git_tree_free(tree);
+	}
 	git_object_free(obj);
 
 	/* use directory name as name */
@@ -1167,56 +4578,34 @@ main(int argc, char *argv[])
 		if (!strcmp(p, ".git"))
 			*p = '\0';
 
-	/* read description or .git/description */
-	joinpath(path, sizeof(path), repodir, "description");
-	if (!(fpread = fopen(path, "r"))) {
-		joinpath(path, sizeof(path), repodir, ".git/description");
-		fpread = fopen(path, "r");
-	}
-	if (fpread) {
-		if (!fgets(description, sizeof(description), fpread))
-			description[0] = '\0';
-		fclose(fpread);
-	}
-
-	/* read url or .git/url */
-	joinpath(path, sizeof(path), repodir, "url");
-	if (!(fpread = fopen(path, "r"))) {
-		joinpath(path, sizeof(path), repodir, ".git/url");
-		fpread = fopen(path, "r");
-	}
-	if (fpread) {
-		if (!fgets(cloneurl, sizeof(cloneurl), fpread))
-			cloneurl[0] = '\0';
-		cloneurl[strcspn(cloneurl, "\n")] = '\0';
-		fclose(fpread);
-	}
-
-	/* check LICENSE */
-	for (i = 0; i < sizeof(licensefiles) / sizeof(*licensefiles) && !license; i++) {
-		if (!git_revparse_single(&obj, repo, licensefiles[i]) &&
-		    git_object_type(obj) == GIT_OBJ_BLOB)
-			license = licensefiles[i] + strlen("HEAD:");
-		git_object_free(obj);
+	readmeta(repo, repodir, &meta);
+	if (treepages)
+		getpagestate(&pagestate);
+	if (manifestfile)
+		manifest_read();
+	if (archivefile) {
+		if (!(archivefp = fopen(archivefile, "a")))
+			err(1, "fopen: '%s'", archivefile);
+		if (fseeko(archivefp, 0, SEEK_END) || (archiveend = ftello(archivefp)) < 0)
+			err(1, "fseeko: '%s'", archivefile);
 	}
-
-	/* check README */
-	for (i = 0; i < sizeof(readmefiles) / sizeof(*readmefiles) && !readme; i++) {
-		if (!git_revparse_single(&obj, repo, readmefiles[i]) &&
-		    git_object_type(obj) == GIT_OBJ_BLOB)
-			readme = readmefiles[i] + strlen("HEAD:");
-		git_object_free(obj);
+	if (changesfile) {
+		if ((fd = mkstemp(changestmppath)) == -1)
+			err(1, "mkstemp");
+		if (!(changesfp = fdopen(fd, "w")))
+			err(1, "fdopen: '%s'", changestmppath);
 	}
 
-	if (!git_revparse_single(&obj, repo, "HEAD:.gitmodules") &&
-	    git_object_type(obj) == GIT_OBJ_BLOB)
-		submodules = ".gitmodules";
-	git_object_free(obj);
+	jobs_start();
 
 	/* log for HEAD */
-	fp = efopen("log.html", "w");
+	fp = pageopen("log.html", head);
 	relpath = "";
-	mkdir("commit", S_IRWXU | S_IRWXG | S_IRWXO);
+	if (!archivefile)
+		mkdir("commit", S_IRWXU | S_IRWXG | S_IRWXO);
+	if (rawfiles && !archivefile)
+		mkdir("blob", S_IRWXU | S_IRWXG | S_IRWXO);
+	relayout = scancommits();
 	writeheader(fp, "Log");
 	fputs("<table id=\"log\"><thead>\n<tr><td><b>Date</b></td>"
 	      "<td><b>Commit message</b></td>"
@@ -1225,8 +4614,9 @@ main(int argc, char *argv[])
 	      "<td class=\"num\" align=\"right\"><b>-</b></td></tr>\n</thead><tbody>\n", fp);
 
 	if (cachefile && head) {
-		/* read from cache file (does not need to exist) */
-		if ((rcachefp = fopen(cachefile, "r"))) {
+		/* read from cache file (does not need to exist), its log lines
+		   link to the old layout after a change of layout */
+		if (!relayout && (rcachefp = fopen(cachefile, "r"))) {
 			if (!fgets(lastoidstr, sizeof(lastoidstr), rcachefp))
 				errx(1, "%s: no object id", cachefile);
 			if (git_oid_fromstr(&lastoid, lastoidstr))
@@ -1243,60 +4633,132 @@ main(int argc, char *argv[])
 		fprintf(wcachefp, "%s\n", buf);
 
 		writelog(fp, head);
-
-		if (rcachefp) {
-			/* append previous log to log.html and the new cache */
-			while (!feof(rcachefp)) {
-				n = fread(buf, 1, sizeof(buf), rcachefp);
-				if (ferror(rcachefp))
-					err(1, "fread");
-				if (fwrite(buf, 1, n, fp) != n ||
-				    fwrite(buf, 1, n, wcachefp) != n)
-					err(1, "fwrite");
-			}
-			fclose(rcachefp);
-		}
-		fclose(wcachefp);
 	} else {
 		if (head)
 			writelog(fp, head);
 	}
-
-	fputs("</tbody></table>", fp);
-	writefooter(fp);
-	fclose(fp);
+	job_call(logend_emit, fp);
 
 	/* files for HEAD */
-	fp = efopen("files.html", "w");
+	fp = pageopen("files.html", head);
 	writeheader(fp, "Files");
 	if (head)
 		writefiles(fp, head);
-	writefooter(fp);
-	fclose(fp);
+	job_call(pageend_emit, fp);
+
+	/* submodules of HEAD, their commits are known once the tree is read */
+	if (hasgitmodules) {
+		fp = pageopen("submodules.html", head);
+		writeheader(fp, "Submodules");
+		writesubmodules(fp);
+		writefooter(fp);
+		pageclose(fp);
+	}
 
-	/* summary page with branches and tags */
-	fp = efopen("refs.html", "w");
-	writeheader(fp, "Refs");
-	writerefs(fp);
-	writefooter(fp);
-	fclose(fp);
+	/* summary page with branches and tags, kept if no reference changed */
+	getrefsstate(refsstate, sizeof(refsstate));
+	if (cachefile) {
+		refcache_read();
+		if (!relayout && !strcmp(refsstate, refcachestate) &&
+		    pageexists("refs.html")) {
+			refcachefile[0] = '\0';
+			manifest_keep("refs.html");
+			manifest_keepdir("tag/");
+		}
+	}
+	if (!cachefile || refcachefile[0]) {
+		if (cachefile) {
+			if ((fd = mkstemp(refstmppath)) == -1)
+				err(1, "mkstemp");
+			if (!(wrefsfp = fdopen(fd, "w")))
+				err(1, "fdopen: '%s'", refstmppath);
+			fprintf(wrefsfp, "%s\n", refsstate);
+		}
+		fp = pageopen("refs.html", NULL);
+		writeheader(fp, "Refs");
+		writerefs(fp);
+		job_call(pageend_emit, fp);
+	}
 
 	/* Atom feed */
-	fp = efopen("atom.xml", "w");
+	fp = pageopen("atom.xml", head);
 	writeatom(fp);
-	fclose(fp);
+	pageclose(fp);
+
+	/* wait for the jobs of all pages */
+	jobs_stop();
+	if (wrefsfp && fclose(wrefsfp))
+		err(1, "fclose: '%s'", refstmppath);
+	if (manifestfile) {
+		if (archivefile)
+			manifest_keepgz();
+		manifest_sweep();
+		manifest_write(manifesttmppath);
+	}
+	if (archivefp && fclose(archivefp))
+		err(1, "fclose: '%s'", archivefile);
+	if (changesfp && fclose(changesfp))
+		err(1, "fclose: '%s'", changestmppath);
+
+	/* all pages must be on disk before the cache file refers to them */
+	if (syncoutput)
+		syncfiles();
 
-	/* rename new cache file on success */
+	/* rename new cache files on success */
 	if (cachefile && head) {
 		if (rename(tmppath, cachefile))
 			err(1, "rename: '%s' to '%s'", tmppath, cachefile);
-		umask((mask = umask(0)));
 		if (chmod(cachefile,
 		    (S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH) & ~mask))
 			err(1, "chmod: '%s'", cachefile);
+		if (syncoutput)
+			syncparentdir(cachefile);
+	}
+	if (manifestfile) {
+		if (rename(manifesttmppath, manifestfile))
+			err(1, "rename: '%s' to '%s'", manifesttmppath, manifestfile);
+		if (chmod(manifestfile,
+		    (S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH) & ~mask))
+			err(1, "chmod: '%s'", manifestfile);
+		if (syncoutput)
+			syncparentdir(manifestfile);
+	}
+	if (changesfile) {
+		if (rename(changestmppath, changesfile))
+			err(1, "rename: '%s' to '%s'", changestmppath, changesfile);
+		if (chmod(changesfile,
+		    (S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH) & ~mask))
+			err(1, "chmod: '%s'", changesfile);
+	}
+	if (wrefsfp) {
+		if (rename(refstmppath, refcachefile))
+			err(1, "rename: '%s' to '%s'", refstmppath, refcachefile);
+		if (chmod(refcachefile,
+		    (S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH) & ~mask))
+			err(1, "chmod: '%s'", refcachefile);
+		if (syncoutput)
+			syncparentdir(refcachefile);
 	}
 
 	/* cleanup */
+	manifest_free();
+	free(pages.ids);
+	free(blobs.ids);
+	for (j = 0; j < nsubmodules; j++) {
+		free(submodules[j].name);
+		free(submodules[j].path);
+		free(submodules[j].url);
+	}
+	free(submodules);
+	for (j = 0; j < ntags; j++) {
+		free(tags[j].name);
+		free(tags[j].refname);
+	}
+	free(tags);
+	refcache_free();
+	git_commit_free(lastparent);
+	git_tree_free(lastparenttree);
+	git_odb_free(odb);
 	git_repository_free(repo);
 	git_libgit2_shutdown();
 
@@ -0,0 +1,183 @@
+#include <err.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <git2.h>
+
+#include "compat.h"
+#include "util.h"
+
+void
+joinpath(char *buf, size_t bufsiz, const char *path, const char *path2)
+{
+	int r;
+
+	r = snprintf(buf, bufsiz, "%s%s%s",
+		path, path[0] && path[strlen(path) - 1] != '/' ? "/" : "", path2);
+	if (r < 0 || (size_t)r >= bufsiz)
+		errx(1, "path truncated: '%s%s%s'",
+			path, path[0] && path[strlen(path) - 1] != '/' ? "/" : "", path2);
+}
+
+/* read the first line of a metadata file in dir */
+void
+readmetafile(const char *dir, const char *file, char *buf, size_t bufsiz)
+{
+	FILE *fp;
+	char path[PATH_MAX];
+
+	buf[0] = '\0';
+	joinpath(path, sizeof(path), dir, file);
+	if (!(fp = fopen(path, "r")))
+		return;
+	if (!fgets(buf, bufsiz, fp))
+		buf[0] = '\0';
+	fclose(fp);
+}
+
+/* read the metadata: the settings in stagit.conf, else the separate
+   description, owner and url files. They are in the directory of a bare
+   repository and in the .git directory of a work tree, decided once */
+void
+readmeta(git_repository *repo, const char *repodir, struct repometa *m)
+{
+	git_config *cfg = NULL, *snap = NULL;
+	const char *s, *dir;
+	char path[PATH_MAX];
+	int hasdesc = 0, hasowner = 0, hasurl = 0;
+
+	if (git_repository_is_bare(repo) || !git_repository_workdir(repo))
+		dir = repodir;
+	else
+		dir = git_repository_path(repo);
+
+	joinpath(path, sizeof(path), dir, "stagit.conf");
+	if (!access(path, R_OK) &&
+	    !git_config_open_ondisk(&cfg, path) &&
+	    !git_config_snapshot(&snap, cfg)) {
+		if (!git_config_get_string(&s, snap, "stagit.description")) {
+			strlcpy(m->description, s, sizeof(m->description));
+			hasdesc = 1;
+		}
+		if (!git_config_get_string(&s, snap, "stagit.owner")) {
+			strlcpy(m->owner, s, sizeof(m->owner));
+			hasowner = 1;
+		}
+		if (!git_config_get_string(&s, snap, "stagit.url")) {
+			strlcpy(m->url, s, sizeof(m->url));
+			hasurl = 1;
+		}
+	}
+	git_config_free(snap);
+	git_config_free(cfg);
+
+	if (!hasdesc)
+		readmetafile(dir, "description", m->description,
+		             sizeof(m->description));
+	if (!hasowner) {
+		readmetafile(dir, "owner", m->owner, sizeof(m->owner));
+		m->owner[strcspn(m->owner, "\n")] = '\0';
+	}
+	if (!hasurl) {
+		readmetafile(dir, "url", m->url, sizeof(m->url));
+		m->url[strcspn(m->url, "\n")] = '\0';
+	}
+}
+
+/* length of the valid UTF-8 sequence at s, else minus the length of its
+   maximal invalid part: overlong forms, surrogates and code points above
+   U+10FFFF are invalid */
+int
+utf8seq(const unsigned char *s, size_t len)
+{
+	unsigned char lo = 0x80, hi = 0xbf;
+	size_t i, need;
+
+	if (s[0] < 0xc2 || s[0] > 0xf4)
+		return -1;
+	if (s[0] < 0xe0) {
+		need = 1;
+	} else if (s[0] < 0xf0) {
+		need = 2;
+		if (s[0] == 0xe0)
+			lo = 0xa0;
+		else if (s[0] == 0xed)
+			hi = 0x9f;
+	} else {
+		need = 3;
+		if (s[0] == 0xf0)
+			lo = 0x90;
+		else if (s[0] == 0xf4)
+			hi = 0x8f;
+	}
+	if (len < 2 || s[1] < lo || s[1] > hi)
+		return -1;
+	for (i = 2; i <= need; i++)
+		if (i >= len || (s[i] & 0xc0) != 0x80)
+			return -(int)i;
+	return need + 1;
+}
+
+/* Escape characters below as HTML 2.0 / XML 1.0. Invalid UTF-8 and the
+   control characters not allowed in XML 1.0 are replaced by U+FFFD. Runs
+   of plain ASCII are checked 8 bytes at a time and written at once. */
+void
+xmlencode(FILE *fp, const char *s, size_t len)
+{
+	const uint64_t ones = 0x0101010101010101ULL, high = 0x8080808080808080ULL;
+	const unsigned char *p = (const unsigned char *)s, *e = p + len, *run;
+	const char *ent;
+	uint64_t w;
+	int n;
+
+#define HASZERO(v) (((v) - ones) & ~(v) & high)
+	for (run = p; p < e; ) {
+		/* no byte >= 0x80, < 0x20 or one of <>'&" */
+		while (e - p >= 8) {
+			memcpy(&w, p, 8);
+			if ((w & high) || HASZERO(w & ~(0x1f * ones)) ||
+			    HASZERO(w ^ ('<' * ones)) || HASZERO(w ^ ('>' * ones)) ||
+			    HASZERO(w ^ ('\'' * ones)) || HASZERO(w ^ ('&' * ones)) ||
+			    HASZERO(w ^ ('"' * ones)))
+				break;
+			p += 8;
+		}
+		if (p >= e)
+			break;
+
+		ent = NULL;
+		n = 1;
+		switch (*p) {
+		case '\0': e = p; continue; /* end of the string */
+		case '<':  ent = "&lt;";   break;
+		case '>':  ent = "&gt;";   break;
+		case '\'': ent = "&#39;";  break;
+		case '&':  ent = "&amp;";  break;
+		case '"':  ent = "&quot;"; break;
+		case '\t': case '\n': case '\r': break;
+		default:
+			if (*p < 0x20)
+				n = -1;
+			else if (*p >= 0x80)
+				n = utf8seq(p, e - p);
+		}
+		if (!ent && n > 0) {
+			p += n;
+			continue;
+		}
+		fwrite(run, 1, p - run, fp);
+		if (ent) {
+			fputs(ent, fp);
+			p++;
+		} else {
+			fputs("\xef\xbf\xbd", fp);
+			p += -n;
+		}
+		run = p;
+	}
+#undef HASZERO
+	fwrite(run, 1, p - run, fp);
+}
@@ -0,0 +1,11 @@
+/* metadata of a repository */
+struct repometa {
+	char description[255];
+	char owner[255];
+	char url[1024];
+};
+
+void joinpath(char *, size_t, const char *, const char *);
+void readmeta(git_repository *, const char *, struct repometa *);
+int utf8seq(const unsigned char *, size_t);
+void xmlencode(FILE *, const char *, size_t);